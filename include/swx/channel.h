@@ -20,7 +20,9 @@
 
 #include <inttypes.h>
 
-#define TOTAL_ANALOG_CHANNELS (3)
+#define TOTAL_ANALOG_CHANNELS (6)
+
+#define AUDIO_BANDS (4) // Number of audio filter bank bands
 
 typedef enum {
    CHANNEL_INVALID = 0,
@@ -30,12 +32,28 @@ typedef enum {
    CHANNEL_READY,
 } channel_status_t;
 
+// Analog capture sources. Samples of every source are left justified to 16 bits for analysis, so the internal ADC keeps its
+// 12 bits and I2S/PCM sources their full 16 bits (24-bit I2S is truncated to the top 16 bits when captured). Levels exposed
+// through registers (thresholds, hysteresis) stay in 10-bit counts, but are compared against the full resolution signal.
 typedef enum {
    AUDIO_CHANNEL_NONE = 0,
 
    AUDIO_CHANNEL_MIC,
    AUDIO_CHANNEL_LEFT,
    AUDIO_CHANNEL_RIGHT,
+
+   AUDIO_CHANNEL_I2S_LEFT, // digital audio input, only on boards with I2S pins
+   AUDIO_CHANNEL_I2S_RIGHT,
+
+   AUDIO_CHANNEL_PCM, // samples uploaded by the I2C master, see REG_PCM_DATA
 } analog_channel_t;
 
+typedef enum {
+   AUDIO_MODE_CROSSING = 0, // pulse on zero crossings
+   AUDIO_MODE_PITCH,        // pulse at the detected pitch, mapped into the frequency parameter min/max
+} audio_mode_t;
+
+// Bit mask for an analog channel in source masks (LSB is AUDIO_CHANNEL_MIC)
+#define ANALOG_SRC_MASK(channel) (1 << ((channel) - AUDIO_CHANNEL_MIC))
+
 #endif // _CHANNEL_H
\ No newline at end of file
@@ -19,7 +19,8 @@
 #define _MESSAGE_H
 
 #define READ_ONLY_ADDRESS_BOUNDARY (0x20)
-#define MAX_STATE_MEM_SIZE (0x900)
+#define STATUS_ADDRESS_BOUNDARY (0xE00) // Registers at and above this address are device status/telemetry (readonly)
+#define MAX_STATE_MEM_SIZE (0x1000)
 
 #define REG_VERSION_w (0)
 
@@ -93,7 +94,10 @@
 
 #define MAX_SEQ_COUNT (128)
 
-#define REG_SEQ_PERIOD (90) // milliseconds (uint16_t)
+// Sequencer slots hold the channel mask enabled while the slot is active. The global sequencer steps through slots 0 to
+// REG_SEQ_COUNT - 1 for all channels, independent sequencers (REG_SEQUENCERn_...) step through their own slot range.
+// Slot durations and slot entry actions are in REG_SEQn_DURATION_w and REG_SEQn_ACTION_w.
+#define REG_SEQ_PERIOD (90) // milliseconds (uint16_t), duration of slots without a duration
 #define REG_SEQ_INDEX (92)
 #define REG_SEQ_COUNT (93) // sequence item count (uint8_t)
 #define REG_SEQn (94)      // max MAX_SEQ_COUNT
@@ -107,6 +111,10 @@
 #define REG_An_PARAM_TARGET (226) // action parameter+target (uint8_t) upper nibble is parameter, lower nibble is target
 #define REG_An_VALUE_w (227)      // action value (uint16_t)
 
+// User variable actions (ACTION_VAR_*, ACTION_IF, ACTION_SELECT) use the channel mask register as the variable index.
+// ACTION_IF uses the parameter+target register as compare_op_t (upper nibble) and the number of guarded actions (lower nibble).
+// ACTION_SELECT/ACTION_SELECT_RANDOM use the lower nibble of parameter+target as the number of actions to choose from.
+
 #define MAX_TRIGS (32)
 #define TRIG_SIZE (4) // size of trig entry in bytes
 
@@ -117,4 +125,243 @@
 
 #define REG_CHn_PARAM_w (1637) // Channel pulse generation parameters. see PARAM_TARGET_INDEX() for required offsets
 
+// Closed-loop power regulation. When enabled, the channel DAC level is adjusted using the sense feedback so the measured output
+// tracks the requested power. Requires REG_CHn_REG_FULL_SCALE_w to be set, otherwise the channel stays open-loop.
+// Sense is sampled inside pulses (gates on), like calibration. A channel that isn't pulsing, or whose pulses (positive + negative
+// width) are shorter than the settle time plus the sense driver sample time (~500 us for the ADS1015), runs open-loop.
+#define REG_CH_REG_ENABLE (2070) // Channel regulation enabled (bit per channel, LSB is 1st channel)
+
+#define CH_REG_SIZE (10) // size of channel regulation entry in bytes
+
+// Regulation entries are stored sequentially and can be accessed using CH_REG_SIZE * ch_index + REG_CHn_REG_...
+#define REG_CHn_REG_FULL_SCALE_w (2071) // uint16_t sense counts expected at full power (CHANNEL_POWER_MAX)
+#define REG_CHn_REG_KP_w (2073)         // uint16_t proportional gain (Q8, power levels per sense count)
+#define REG_CHn_REG_KI_w (2075)         // uint16_t integral gain (Q8, power levels per sense count per loop update)
+#define REG_CHn_REG_SLEW_w (2077)       // uint16_t max change in power level per loop update
+#define REG_CHn_REG_CEILING_w (2079)    // uint16_t max power level the loop can drive the channel to, 0 is the requested power + a small margin
+
+// Analog capture config, applied live. Registers read back the applied values, since they are clamped to what the hardware supports.
+// Active sources are sampled round robin by the internal ADC, so fewer sources allow a higher rate or shorter buffers (less latency).
+#define REG_CAPTURE_SRC (2111)      // uint8_t active capture sources (bit per analog_channel_t, see ANALOG_SRC_MASK)
+#define REG_CAPTURE_RATE_w (2112)   // uint16_t per source sample rate in 10 Hz units (e.g. 4410 is 44.1 kHz), shared by all sources
+#define REG_CAPTURE_LENGTH_w (2114) // uint16_t samples per source in each capture buffer
+
+// Audio processing. Each audio source is analyzed once per capture buffer, samples are DC blocked and zero crossings found.
+// Per channel, an attack/release envelope follower tracks the source level, optionally scaled by automatic gain control (AGC).
+// The channel power is scaled by the resulting level, with an amplitude of 128 counts as full power.
+#define AUDIO_SIZE (12) // size of channel audio entry in bytes
+
+// Audio entries are stored sequentially and can be accessed using AUDIO_SIZE * ch_index + REG_CHn_AUDIO_...
+#define REG_CHn_AUDIO_ATTACK_w (2116)       // uint16_t envelope attack time constant in milliseconds
+#define REG_CHn_AUDIO_RELEASE_w (2118)      // uint16_t envelope release time constant in milliseconds
+#define REG_CHn_AUDIO_GATE_w (2120)         // uint16_t noise gate, envelope level in counts below which no pulses are generated
+#define REG_CHn_AUDIO_AGC_TARGET_w (2122)   // uint16_t AGC target envelope level in counts, 0 disables AGC
+#define REG_CHn_AUDIO_AGC_MAX_GAIN_w (2124) // uint16_t AGC max gain (Q8, 256 is unity)
+#define REG_CHn_AUDIO_AGC_TIME_w (2126)     // uint16_t AGC gain adjustment time constant in milliseconds
+
+#define REG_CHn_AUDIO_MODE (2164) // Channel audio mode. see audio_mode_t
+#define REG_CH1_AUDIO_MODE (REG_CHn_AUDIO_MODE + 0)
+#define REG_CH2_AUDIO_MODE (REG_CHn_AUDIO_MODE + 1)
+#define REG_CH3_AUDIO_MODE (REG_CHn_AUDIO_MODE + 2)
+#define REG_CH4_AUDIO_MODE (REG_CHn_AUDIO_MODE + 3)
+
+#define REG_CHn_AUDIO_BAND (2168) // Channel audio frequency band, 0 for broadband or 1 to AUDIO_BANDS (bass to treble)
+#define REG_CH1_AUDIO_BAND (REG_CHn_AUDIO_BAND + 0)
+#define REG_CH2_AUDIO_BAND (REG_CHn_AUDIO_BAND + 1)
+#define REG_CH3_AUDIO_BAND (REG_CHn_AUDIO_BAND + 2)
+#define REG_CH4_AUDIO_BAND (REG_CHn_AUDIO_BAND + 3)
+
+// Trigger input sources, one uint16_t per trig entry accessed using REG_TRIGn_SOURCE_w + index * 2. 4 bits per input (LSB is input 1):
+// 0 is the trigger pin, TRIGGER_SOURCE_THRESHOLD + n is analog threshold n (see REG_THRESHn_SOURCE), otherwise the input is pulsed
+// by onsets of that audio source (see analog_channel_t)
+#define REG_TRIGn_SOURCE_w (2172)
+#define TRIGGER_SOURCE_THRESHOLD (12)
+
+// I2S digital audio capture (boards with I2S pins only), enabled with the AUDIO_CHANNEL_I2S_* bits of REG_CAPTURE_SRC.
+// The device is the clock master, generating BCLK and WS. Registers read back the applied values, like analog capture.
+#define REG_I2S_RATE_w (2236)   // uint16_t sample rate in 10 Hz units (e.g. 4410 is 44.1 kHz, 4800 is 48 kHz)
+#define REG_I2S_LENGTH_w (2238) // uint16_t frames (left and right sample) in each capture buffer
+#define REG_I2S_BITS (2240)     // uint8_t sample bits, 16 (16 bit slots) or 24 (32 bit slots, 64 BCLK per frame)
+
+// Low latency audio. Capture buffers are limited to ~1 ms so samples are processed soon after they are taken. The capture length
+// registers keep the requested length, the duration registers read back the limited buffer. Audio pulses are scheduled using a lookahead sized from the measured processing delay
+// and pulse queue depth, instead of a fixed 20 ms (see REG_CHn_AUDIO_LATENCY_w).
+#define REG_AUDIO_LOW_LATENCY (2241) // uint8_t low latency audio enabled (bool)
+
+// Host PCM upload, an audio source (AUDIO_CHANNEL_PCM) streamed by the I2C master, enabled with its REG_CAPTURE_SRC bit.
+// Samples are signed 16 bit mono, little endian. Every byte written to REG_PCM_DATA is appended to a ring buffer (the address
+// doesn't advance), each write must contain whole samples. Once a buffer worth of samples is queued, buffers are played out at
+// the sample rate on the device clock. Keep the ring filled using REG_PCM_FILL_w, an underrun restarts playback once refilled.
+// Throughput is limited by the I2C bus: 16 bit samples need 18 bus clocks each, before addressing and other traffic. So a 100 kHz
+// bus (I2C_FREQ_COMMS) carries ~5k samples/s at best, and the rate is clamped to ~4.1 kHz (range scales with the bus clock).
+#define REG_PCM_DATA (2242)     // uint8_t sample data stream (write only)
+#define REG_PCM_RATE_w (2243)   // uint16_t sample rate in 10 Hz units, clamped to what the I2C bus sustains (see above)
+#define REG_PCM_LENGTH_w (2245) // uint16_t samples in each buffer
+
+#define MAX_AUDIO_SRCS (8) // max analog_channel_t sources with register entries
+#define AUDIO_SRC_SIZE (8) // size of audio source entry in bytes, unused bytes are reserved
+
+// Audio source entries are stored sequentially and can be accessed using AUDIO_SRC_SIZE * (analog_channel_t - 1) + REG_SRCn_...
+#define REG_SRCn_DC_SHIFT (2247)   // uint8_t DC blocking filter pole as 1 - 2^-n, 1-15 (8 is ~27 Hz at 44.1 kHz, above 15 is clamped), 0 disables
+#define REG_SRCn_HYSTERESIS (2248) // uint8_t zero crossing hysteresis in counts, signal must exceed +/- this level to count as a crossing
+
+// Onset (beat) detection. An onset is when the short term source energy rises above the long term average by the sensitivity ratio.
+// Onsets launch the source action list, and can be used as trigger inputs (see REG_TRIGn_SOURCE_w).
+#define REG_SRCn_ONSET_SENSITIVITY (2249)  // uint8_t onset sensitivity, energy ratio needed is 1 + (256 - n) / 32 (224 is 2x), 0 disables
+#define REG_SRCn_ONSET_REFRACTORY_w (2250) // uint16_t minimum time between onsets in milliseconds
+#define REG_SRCn_ONSET_ACTION_w (2252)     // uint16_t action list run on onset, upper byte: action_start_index, lower byte: action_end_index
+
+// Trigger input debounce, one uint16_t per trigger input accessed using REG_TRIG_DEBOUNCE_w + input * 2. Edges are timestamped when
+// they happen, and triggers are evaluated on every debounced edge. An edge is taken immediately, then edges within the debounce
+// time are ignored. If the input settled at a different level by the end of the debounce time, that is taken as the next edge.
+#define REG_TRIG_DEBOUNCE_w (2311) // uint16_t debounce time in microseconds
+
+// Trigger truth tables, one uint16_t per trig entry accessed using REG_TRIGn_TABLE_w + index * 2. Used when the trig entry op is
+// TRIGGER_OP_TABLE, allowing any boolean function of the inputs. The result is bit n of the table, where n is the masked and
+// inverted input state (LSB is input 1). E.g. 0x6666 is t1 XOR t2, 0x8888 is t1 && t2.
+#define REG_TRIGn_TABLE_w (2319)
+
+#define MAX_THRESHOLDS (4)
+#define THRESHOLD_SIZE (6) // size of threshold entry in bytes
+
+// Analog threshold trigger inputs, so boards without trigger pins can react to external signals. A threshold goes high once its
+// value rises to the on level, and low once it falls below the off level (on - off is the hysteresis). Capture sources are checked
+// every block of 16 samples, sense sources every update. Used as trigger inputs with REG_TRIGn_SOURCE_w.
+// Threshold entries are stored sequentially and can be accessed using THRESHOLD_SIZE * index + REG_THRESHn_...
+#define REG_THRESHn_SOURCE (2383) // uint8_t analog_channel_t, or THRESHOLD_SOURCE_SENSE + channel index for channel sense readings
+#define REG_THRESHn_MODE (2384)   // threshold_mode_t
+#define REG_THRESHn_ON_w (2385)   // uint16_t on level
+#define REG_THRESHn_OFF_w (2387)  // uint16_t off level
+#define THRESHOLD_SOURCE_SENSE (0x80)
+
+#define MAX_TIMERS (8)
+#define TIMER_SIZE (13) // size of timer entry in bytes
+
+// Timer triggers, running an action list on a schedule from the device clock so patterns don't need host timed writes.
+// A timer starts when its enable register is set, timers started by the same write share a start time so they stay in phase.
+// Firings are at start + phase + n * period, so they don't drift. The enable register is cleared once the repeat count is reached.
+// Timer entries are stored sequentially and can be accessed using TIMER_SIZE * index + REG_TIMERn_...
+#define REG_TIMERn_ENABLE (2407)    // uint8_t timer running (bool)
+#define REG_TIMERn_PERIOD_dw (2408) // uint32_t time between firings in microseconds, 0 fires once
+#define REG_TIMERn_PHASE_dw (2412)  // uint32_t time from start until the first firing in microseconds
+#define REG_TIMERn_REPEAT_w (2416)  // uint16_t number of firings, 0 repeats until disabled
+#define REG_TIMERn_ACTION_w (2418)  // uint16_t action list, upper byte: action_start_index, lower byte: action_end_index
+
+#define MAX_VARS (16)
+
+// User variables, read and written by actions for counters, branching and random selection.
+// Variables are uint16_t and can be accessed using 2 * index + REG_VARn_w
+#define REG_VARn_w (2511)
+
+// Per slot sequencer timing and actions, accessed using 2 * slot + REG_SEQn_...
+// A sequencer is disabled (all channels enabled) while its current slot has no duration.
+#define REG_SEQn_DURATION_w (2543) // uint16_t slot duration in milliseconds, 0 uses REG_SEQ_PERIOD
+#define REG_SEQn_ACTION_w (2799)   // uint16_t action list run on entering the slot, upper byte: action_start_index, lower byte: action_end_index
+
+#define MAX_SEQUENCERS (4)
+#define SEQUENCER_SIZE (4) // size of sequencer entry in bytes
+
+// Independent sequencers, each stepping through its own range of slots for the channels in its mask.
+// Channels not in any sequencer mask follow the global sequencer (REG_SEQ_...). Writing the index register jumps to that slot.
+// Sequencer entries are stored sequentially and can be accessed using SEQUENCER_SIZE * index + REG_SEQUENCERn_...
+#define REG_SEQUENCERn_CHANNEL_MASK (3055) // uint8_t channels gated by the sequencer, 0 disables the sequencer
+#define REG_SEQUENCERn_START (3056)        // uint8_t first slot
+#define REG_SEQUENCERn_COUNT (3057)        // uint8_t slot count
+#define REG_SEQUENCERn_INDEX (3058)        // uint8_t current slot, relative to the first slot
+
+// Keyframe automation, a parameter in TARGET_MODE_KEYFRAMES or TARGET_MODE_KEYFRAMES_LOOP follows a range of its channel's keyframes.
+// The value moves from each keyframe to the next using the keyframe's curve, and holds at the last keyframe once its time is reached.
+// Keyframes restart when parameter_update() is called (CMD_PARAM_UPDATE or ACTION_PARAM_UPDATE), and run the parameter's
+// TARGET_ACTION_RANGE each time the last keyframe is reached.
+// Ranges can be accessed using 2 * (ch_index * TOTAL_PARAMS + param) + REG_CHn_PARAMn_KEYFRAMES_w
+#define REG_CHn_PARAMn_KEYFRAMES_w (3071) // uint16_t keyframe range, upper byte: keyframe_start_index, lower byte: keyframe_end_index
+
+#define MAX_KEYFRAMES (16) // keyframes per channel
+#define KEYFRAME_SIZE (5)  // size of keyframe entry in bytes
+
+// Keyframe entries are stored sequentially per channel and can be accessed using KEYFRAME_SIZE * (ch_index * MAX_KEYFRAMES + index) + REG_KFn_...
+#define REG_KFn_TIME_w (3143)  // uint16_t time from the start of the keyframes in milliseconds, must not decrease between keyframes
+#define REG_KFn_VALUE_w (3145) // uint16_t parameter value at the keyframe time
+#define REG_KFn_CURVE (3147)   // keyframe_curve_t shape of the change from this keyframe to the next
+
+// Shape of the power transition during PARAM_ON_RAMP_TIME and PARAM_OFF_RAMP_TIME, the off ramp runs the curve backwards
+#define REG_CHn_RAMP_CURVE (3463) // ramp_curve_t
+#define REG_CH1_RAMP_CURVE (REG_CHn_RAMP_CURVE + 0)
+#define REG_CH2_RAMP_CURVE (REG_CHn_RAMP_CURVE + 1)
+#define REG_CH3_RAMP_CURVE (REG_CHn_RAMP_CURVE + 2)
+#define REG_CH4_RAMP_CURVE (REG_CHn_RAMP_CURVE + 3)
+
+// ------------------------ STATUS REGISTERS (readonly) -----------------------
+
+#define REG_CHn_SENSE_w (0xE00) // uint16_t last channel sense reading in counts, sampled every regulation period (inside a pulse while pulsing)
+#define REG_CH1_SENSE_w (REG_CHn_SENSE_w + 0)
+#define REG_CH2_SENSE_w (REG_CHn_SENSE_w + 2)
+#define REG_CH3_SENSE_w (REG_CHn_SENSE_w + 4)
+#define REG_CH4_SENSE_w (REG_CHn_SENSE_w + 6)
+
+#define REG_CHn_REG_ERROR_w (0xE08) // int16_t last regulation loop error in sense counts (setpoint - measured)
+#define REG_CH1_REG_ERROR_w (REG_CHn_REG_ERROR_w + 0)
+#define REG_CH2_REG_ERROR_w (REG_CHn_REG_ERROR_w + 2)
+#define REG_CH3_REG_ERROR_w (REG_CHn_REG_ERROR_w + 4)
+#define REG_CH4_REG_ERROR_w (REG_CHn_REG_ERROR_w + 6)
+
+#define REG_CHn_REG_SAT_COUNT_w (0xE10) // uint16_t number of loop updates limited by slew or ceiling (wraps)
+#define REG_CH1_REG_SAT_COUNT_w (REG_CHn_REG_SAT_COUNT_w + 0)
+#define REG_CH2_REG_SAT_COUNT_w (REG_CHn_REG_SAT_COUNT_w + 2)
+#define REG_CH3_REG_SAT_COUNT_w (REG_CHn_REG_SAT_COUNT_w + 4)
+#define REG_CH4_REG_SAT_COUNT_w (REG_CHn_REG_SAT_COUNT_w + 6)
+
+#define REG_CAPTURE_DURATION_w (0xE18) // uint16_t duration of a capture buffer in microseconds (saturates)
+
+#define REG_CHn_AUDIO_LEVEL_w (0xE1A) // uint16_t audio envelope level in counts (before AGC)
+#define REG_CH1_AUDIO_LEVEL_w (REG_CHn_AUDIO_LEVEL_w + 0)
+#define REG_CH2_AUDIO_LEVEL_w (REG_CHn_AUDIO_LEVEL_w + 2)
+#define REG_CH3_AUDIO_LEVEL_w (REG_CHn_AUDIO_LEVEL_w + 4)
+#define REG_CH4_AUDIO_LEVEL_w (REG_CHn_AUDIO_LEVEL_w + 6)
+
+#define REG_CHn_AUDIO_GAIN_w (0xE22) // uint16_t current AGC gain (Q8, 256 is unity)
+#define REG_CH1_AUDIO_GAIN_w (REG_CHn_AUDIO_GAIN_w + 0)
+#define REG_CH2_AUDIO_GAIN_w (REG_CHn_AUDIO_GAIN_w + 2)
+#define REG_CH3_AUDIO_GAIN_w (REG_CHn_AUDIO_GAIN_w + 4)
+#define REG_CH4_AUDIO_GAIN_w (REG_CHn_AUDIO_GAIN_w + 6)
+
+#define AUDIO_SRC_STATUS_SIZE (4) // size of audio source status entry in bytes
+
+// Audio source status entries are stored sequentially and can be accessed using AUDIO_SRC_STATUS_SIZE * (analog_channel_t - 1) + REG_SRCn_...
+#define REG_SRCn_PITCH_w (0xE2A)       // uint16_t detected pitch in dHz, 0 if not periodic (only updated while a channel uses pitch mode)
+#define REG_SRCn_ONSET_COUNT_w (0xE2C) // uint16_t number of onsets detected (wraps)
+
+#define REG_I2S_DURATION_w (0xE4A) // uint16_t duration of an I2S capture buffer in microseconds (saturates)
+
+#define REG_CHn_AUDIO_LATENCY_w (0xE4C) // uint16_t audio lookahead in microseconds, time from a sample being taken to its pulse (saturates)
+#define REG_CH1_AUDIO_LATENCY_w (REG_CHn_AUDIO_LATENCY_w + 0)
+#define REG_CH2_AUDIO_LATENCY_w (REG_CHn_AUDIO_LATENCY_w + 2)
+#define REG_CH3_AUDIO_LATENCY_w (REG_CHn_AUDIO_LATENCY_w + 4)
+#define REG_CH4_AUDIO_LATENCY_w (REG_CHn_AUDIO_LATENCY_w + 6)
+
+#define REG_PCM_FILL_w (0xE54)      // uint16_t samples queued in the PCM upload ring
+#define REG_PCM_UNDERRUNS_w (0xE56) // uint16_t number of PCM buffers that weren't uploaded in time (wraps)
+#define REG_PCM_OVERRUNS_w (0xE58)  // uint16_t number of PCM samples dropped since the ring was full (wraps)
+
+#define REG_TRIG_EDGE_OVERRUNS_w (0xE5A) // uint16_t number of trigger input edges dropped since the edge FIFO was full (wraps)
+#define REG_TRIG_INPUT_STATE (0xE5C)     // uint8_t debounced trigger input levels (bit per input, LSB is input 1)
+
+#define REG_THRESH_STATE (0xE5D)    // uint8_t analog threshold states (bit per threshold, LSB is threshold 0)
+#define REG_THRESHn_VALUE_w (0xE5E) // uint16_t latest value compared by each threshold, accessed using REG_THRESHn_VALUE_w + index * 2
+
+#define REG_TIMERn_COUNT_w (0xE66) // uint16_t number of firings since the timer started, accessed using REG_TIMERn_COUNT_w + index * 2
+
+// Action list execution cost, for the most recent execute_action_list() call (including nested lists)
+#define REG_ACTION_STEPS_w (0xE76)      // uint16_t actions run
+#define REG_ACTION_PEAK_STEPS_w (0xE78) // uint16_t most actions run by a single call since startup
+#define REG_ACTION_DURATION_w (0xE7A)   // uint16_t execution time in microseconds (saturates)
+#define REG_ACTION_ABORTS_w (0xE7C)     // uint16_t number of calls that hit the step budget, depth limit, or a cycle (wraps)
+
+// Delayed channel generation changes (ACTION_ENABLE/DISABLE/TOGGLE with a delay)
+#define REG_DELAY_PENDING (0xE7E)     // uint8_t delayed changes waiting to be applied
+#define REG_DELAY_PEAK (0xE7F)        // uint8_t most delayed changes pending at once since startup
+#define REG_DELAY_OVERFLOWS_w (0xE80) // uint16_t number of delayed changes dropped since all slots were in use (wraps)
+
+#define REG_CH_REG_CLOSED (0xE82) // uint8_t channels regulated from a sense reading in the last regulation round (bit per channel)
+
 #endif // _MESSAGE_H
\ No newline at end of file
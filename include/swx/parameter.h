@@ -97,10 +97,32 @@ typedef enum {
    /// Ramp smoothly from maximum to minimum and then disable cycling.
    TARGET_MODE_DOWN,
 
-   TARGET_MODE_RESERVED_NOT_USED_1
+   TARGET_MODE_RESERVED_NOT_USED_1,
+
+   /// Follow the parameter's keyframes (see REG_CHn_PARAMn_KEYFRAMES_w) once and then disable cycling.
+   TARGET_MODE_KEYFRAMES,
+
+   /// Follow the parameter's keyframes, restarting from the first keyframe after the last one.
+   TARGET_MODE_KEYFRAMES_LOOP,
 
 } target_mode_t;
 
+typedef enum {
+   KEYFRAME_CURVE_LINEAR = 0, // straight line to the next keyframe
+   KEYFRAME_CURVE_HOLD,       // hold the value until the next keyframe
+   KEYFRAME_CURVE_EASE_IN,    // slow start, fast end (quadratic)
+   KEYFRAME_CURVE_EASE_OUT,   // fast start, slow end (quadratic)
+   KEYFRAME_CURVE_SMOOTH,     // slow start and end (smoothstep)
+} keyframe_curve_t;
+
+typedef enum {
+   RAMP_CURVE_LINEAR = 0,  // constant rate of change
+   RAMP_CURVE_EXPONENTIAL, // slow start, fast end
+   RAMP_CURVE_S_CURVE,     // slow start and end (smootherstep)
+   RAMP_CURVE_LOGARITHMIC, // fast start, slow end
+   TOTAL_RAMP_CURVES,      // Number of curves in enum
+} ramp_curve_t;
+
 typedef enum {
    ACTION_NONE = 0,
 
@@ -127,8 +149,42 @@ typedef enum {
 
    /// Update a parameter for one or more channels.
    ACTION_PARAM_UPDATE,
+
+   /// Cancel pending delayed enable/disable/toggle changes for one or more channels.
+   ACTION_CANCEL,
+
+   /// Set a user variable to the action value.
+   ACTION_VAR_SET,
+
+   /// Add the action value to a user variable. Value is signed (int16_t), the variable wraps.
+   ACTION_VAR_ADD,
+
+   /// Increment a user variable. If value is above zero, the variable resets to zero when it reaches value.
+   ACTION_VAR_COUNT,
+
+   /// Set a user variable to a random value below the action value, or any value if zero.
+   ACTION_VAR_RANDOM,
+
+   /// Compare a user variable with the action value. If false, skip the next count actions in the list.
+   ACTION_IF,
+
+   /// Run one of the next count actions, chosen by a user variable (modulo count). Then skip past all count actions.
+   ACTION_SELECT,
+
+   /// Run one of the next count actions, chosen at random. Then skip past all count actions.
+   ACTION_SELECT_RANDOM,
 } action_type_t;
 
+typedef enum {
+   COMPARE_EQ = 0, // var == value
+   COMPARE_NE,     // var != value
+   COMPARE_LT,     // var < value
+   COMPARE_LE,     // var <= value
+   COMPARE_GT,     // var > value
+   COMPARE_GE,     // var >= value
+   COMPARE_AND,    // (var & value) != 0
+} compare_op_t;
+
 typedef enum {
    TRIGGER_OP_DDD = 0, // disabled
    TRIGGER_OP_OOO, // t1 || t2 || t3 || t4
@@ -139,8 +195,15 @@ typedef enum {
    TRIGGER_OP_AOA, // t1 && t2 || t3 && t4
    TRIGGER_OP_AAO, // t1 && t2 && t3 || t4
    TRIGGER_OP_AAA, // t1 && t2 && t3 && t4
+   TRIGGER_OP_TABLE, // truth table, see REG_TRIGn_TABLE_w
 } trigger_op_t;
 
+typedef enum {
+   THRESHOLD_MODE_DISABLED = 0,
+   THRESHOLD_MODE_LEVEL,    // mean level of each block of samples (10-bit counts), or the channel sense reading (counts)
+   THRESHOLD_MODE_ENVELOPE, // peak amplitude of each block of samples after DC blocking (counts), same as level for sense sources
+} threshold_mode_t;
+
 #define PARAM_TARGET_INDEX_OFFSET(param, target) ((((param)*2) * TOTAL_TARGETS) + ((target)*2))
 #define PARAM_TARGET_INDEX_TOTAL (PARAM_TARGET_INDEX_OFFSET(TOTAL_PARAMS - 1, TOTAL_TARGETS - 1))
 
@@ -0,0 +1,502 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "action.h"
+
+#include "parameter.h"
+#include "message.h"
+#include "state.h"
+#include "pulse_gen.h"
+
+#include <hardware/structs/rosc.h>
+
+#define ALL_CHANNELS_MASK ((1 << CHANNEL_COUNT) - 1)
+
+// Decoded action, see REG_An_*
+typedef struct {
+   uint8_t type;         // action_type_t
+   uint8_t channel_mask; // channels, limited to CHANNEL_COUNT
+   uint8_t var;          // variable index (REG_VARn_w), from the channel mask register
+   union {
+      uint8_t param; // param_t
+      uint8_t op;    // compare_op_t of ACTION_IF
+   };
+   union {
+      uint8_t target; // target_t
+      uint8_t count;  // actions guarded by ACTION_IF, or selected from by ACTION_SELECT*
+   };
+   uint16_t value;
+} compiled_action_t;
+
+// Action list being executed
+typedef struct {
+   uint8_t end;
+   uint8_t index;  // next action to execute
+   uint8_t caller; // action that started the next frame (ACTION_EXECUTE or ACTION_SELECT*)
+} action_frame_t;
+
+static compiled_action_t actions[MAX_ACTIONS];
+
+static uint16_t peak_steps = 0;
+static uint16_t aborts = 0;
+
+#define DELAY_WHEEL_SIZE (64) // 1 ms ticks, longer delays wait for the wheel to come around, must be a power of 2
+#define DELAY_WHEEL_MASK (DELAY_WHEEL_SIZE - 1)
+#define DELAY_NONE (0xFF)     // end of a slot list
+
+// Channel generation change applied after a delay, see ACTION_ENABLE/DISABLE/TOGGLE
+typedef struct {
+   uint32_t due_ms;      // time to apply in milliseconds
+   uint8_t type;         // action_type_t applied when due
+   uint8_t channel_mask;
+   uint8_t next;         // next slot in the bucket or free list
+} delayed_action_t;
+
+static delayed_action_t delayed[ACTION_DELAY_SLOTS];
+static uint8_t wheel_head[DELAY_WHEEL_SIZE]; // first slot due in each bucket (due_ms modulo wheel size)
+static uint8_t wheel_tail[DELAY_WHEEL_SIZE]; // last slot, so slots are appended in schedule order
+static uint32_t wheel_tick;                  // next tick to visit in milliseconds
+static uint8_t delay_free;                   // first free slot
+static uint8_t delay_pending = 0;
+static uint8_t delay_peak = 0;
+static uint16_t delay_overflows = 0;
+static_assert(ACTION_DELAY_SLOTS < DELAY_NONE); // Ensure slots can be linked using uint8_t
+
+// Decode and validate the action at the given action slot index
+static void compile_action(uint8_t a_index) {
+   const uint16_t offset = ACTION_SIZE * a_index;
+   compiled_action_t* a = &actions[a_index];
+
+   a->type = get_state(REG_An_TYPE + offset);
+   a->var = get_state(REG_An_CHANNEL_MASK + offset);
+   a->channel_mask = a->var & ALL_CHANNELS_MASK;
+   a->value = get_state16(REG_An_VALUE_w + offset);
+
+   const uint8_t param_target = get_state(REG_An_PARAM_TARGET + offset);
+   a->param = param_target >> 4;    // upper nibble
+   a->target = param_target & 0x0f; // lower nibble
+
+   bool valid;
+   switch (a->type) {
+      case ACTION_SET:
+      case ACTION_INCREMENT:
+      case ACTION_DECREMENT:
+         valid = a->channel_mask && a->param < TOTAL_PARAMS && a->target < TOTAL_TARGETS;
+         break;
+      case ACTION_ENABLE:
+      case ACTION_DISABLE:
+      case ACTION_TOGGLE:
+      case ACTION_CANCEL:
+         valid = a->channel_mask;
+         break;
+      case ACTION_EXECUTE:
+         valid = (a->value >> 8) < (a->value & 0xff);
+         break;
+      case ACTION_PARAM_UPDATE:
+         valid = a->channel_mask && a->param < TOTAL_PARAMS;
+         break;
+      case ACTION_VAR_SET:
+      case ACTION_VAR_ADD:
+      case ACTION_VAR_COUNT:
+      case ACTION_VAR_RANDOM:
+         valid = a->var < MAX_VARS;
+         break;
+      case ACTION_IF:
+         valid = a->var < MAX_VARS && a->op <= COMPARE_AND && a->count;
+         break;
+      case ACTION_SELECT:
+         valid = a->var < MAX_VARS && a->count;
+         break;
+      case ACTION_SELECT_RANDOM:
+         valid = a->count;
+         break;
+      default:
+         valid = false;
+         break;
+   }
+
+   if (!valid)
+      a->type = ACTION_NONE;
+}
+
+void actions_configure() {
+   static uint8_t cache[ACTION_SIZE * MAX_ACTIONS];
+   static bool compiled = false;
+
+   for (uint8_t a_index = 0; a_index < MAX_ACTIONS; a_index++) {
+      const uint16_t offset = ACTION_SIZE * a_index;
+
+      bool changed = !compiled;
+      for (uint8_t i = 0; i < ACTION_SIZE; i++) {
+         const uint8_t value = get_state(REG_An_TYPE + offset + i);
+         if (cache[offset + i] != value) {
+            cache[offset + i] = value;
+            changed = true;
+         }
+      }
+
+      if (changed)
+         compile_action(a_index);
+   }
+   compiled = true;
+}
+
+static uint32_t random_state = 1;
+
+static inline uint16_t get_var(uint8_t index) {
+   return get_state16(REG_VARn_w + index * 2);
+}
+
+static inline void set_var(uint8_t index, uint16_t value) {
+   set_state16(REG_VARn_w + index * 2, value);
+}
+
+// xorshift32, seeded from the ring oscillator at init
+static inline uint32_t random_next() {
+   random_state ^= random_state << 13;
+   random_state ^= random_state >> 17;
+   random_state ^= random_state << 5;
+   return random_state;
+}
+
+// Returns a random value from 0 to n - 1
+static inline uint16_t random_below(uint16_t n) {
+   return ((random_next() >> 16) * n) >> 16;
+}
+
+// Apply a channel generation enable, disable, or toggle for the channel mask
+static inline void apply_gen_enable(action_type_t type, uint8_t channel_mask) {
+   const uint8_t enabled = get_state(REG_CH_GEN_ENABLE);
+   if (type == ACTION_ENABLE)
+      set_state(REG_CH_GEN_ENABLE, enabled | channel_mask);
+   else if (type == ACTION_DISABLE)
+      set_state(REG_CH_GEN_ENABLE, enabled & ~channel_mask);
+   else
+      set_state(REG_CH_GEN_ENABLE, enabled ^ channel_mask);
+}
+
+static inline void update_delay_telemetry() {
+   set_state(REG_DELAY_PENDING, delay_pending);
+   if (delay_pending > delay_peak) {
+      delay_peak = delay_pending;
+      set_state(REG_DELAY_PEAK, delay_peak);
+   }
+}
+
+// Schedule a channel generation change after the delay in milliseconds. Entries due at the same time are applied in the order
+// they were scheduled. Dropped (and counted) if the pool is full.
+static void schedule_delayed(action_type_t type, uint8_t channel_mask, uint16_t delay_ms) {
+   const uint8_t slot = delay_free;
+   if (slot == DELAY_NONE) {
+      set_state16(REG_DELAY_OVERFLOWS_w, ++delay_overflows);
+      return;
+   }
+   delay_free = delayed[slot].next;
+
+   // A delay always lands on a later tick, so entries aren't added behind the wheel
+   const uint32_t now_ms = time_us_64() / 1000;
+   if (delay_pending == 0)
+      wheel_tick = now_ms; // nothing pending, so the wheel can skip ahead
+
+   delayed_action_t* d = &delayed[slot];
+   d->due_ms = MAX(now_ms + delay_ms, wheel_tick);
+   d->type = type;
+   d->channel_mask = channel_mask;
+   d->next = DELAY_NONE;
+
+   // Append to the bucket, so ordering within a bucket is by schedule order
+   const uint8_t bucket = d->due_ms & DELAY_WHEEL_MASK;
+   if (wheel_tail[bucket] == DELAY_NONE)
+      wheel_head[bucket] = slot;
+   else
+      delayed[wheel_tail[bucket]].next = slot;
+   wheel_tail[bucket] = slot;
+
+   delay_pending++;
+   update_delay_telemetry();
+}
+
+// Remove the entry from the bucket and return it to the pool
+static inline void free_delayed(uint8_t bucket, uint8_t prev, uint8_t slot) {
+   const uint8_t next = delayed[slot].next;
+   if (prev == DELAY_NONE)
+      wheel_head[bucket] = next;
+   else
+      delayed[prev].next = next;
+   if (wheel_tail[bucket] == slot)
+      wheel_tail[bucket] = prev;
+
+   delayed[slot].next = delay_free;
+   delay_free = slot;
+   delay_pending--;
+}
+
+// Cancel pending delayed changes for the channels in the mask
+static void cancel_delayed(uint8_t channel_mask) {
+   for (uint8_t bucket = 0; bucket < DELAY_WHEEL_SIZE; bucket++) {
+      uint8_t prev = DELAY_NONE;
+      for (uint8_t slot = wheel_head[bucket]; slot != DELAY_NONE;) {
+         const uint8_t next = delayed[slot].next;
+
+         delayed[slot].channel_mask &= ~channel_mask;
+         if (delayed[slot].channel_mask)
+            prev = slot;
+         else
+            free_delayed(bucket, prev, slot);
+
+         slot = next;
+      }
+   }
+   update_delay_telemetry();
+}
+
+void actions_init() {
+   for (uint8_t bucket = 0; bucket < DELAY_WHEEL_SIZE; bucket++) {
+      wheel_head[bucket] = DELAY_NONE;
+      wheel_tail[bucket] = DELAY_NONE;
+   }
+   for (uint8_t slot = 0; slot < ACTION_DELAY_SLOTS; slot++)
+      delayed[slot].next = slot + 1 < ACTION_DELAY_SLOTS ? slot + 1 : DELAY_NONE;
+   delay_free = 0;
+   delay_pending = 0;
+   wheel_tick = time_us_64() / 1000;
+
+   update_delay_telemetry();
+
+   // The ring oscillator random bit is too slow and biased to use directly, but fine for a seed
+   for (uint8_t i = 0; i < 32; i++)
+      random_state = (random_state << 1) ^ rosc_hw->randombit ^ (time_us_32() & 1);
+   if (random_state == 0)
+      random_state = 1;
+}
+
+void actions_process() {
+   if (delay_pending == 0)
+      return;
+
+   // Visit every tick up to now, so entries are applied in due order even if the main loop was held up
+   const uint32_t now_ms = time_us_64() / 1000;
+   for (; (int32_t)(now_ms - wheel_tick) >= 0 && delay_pending; wheel_tick++) {
+      const uint8_t bucket = wheel_tick & DELAY_WHEEL_MASK;
+
+      uint8_t prev = DELAY_NONE;
+      for (uint8_t slot = wheel_head[bucket]; slot != DELAY_NONE;) {
+         const uint8_t next = delayed[slot].next;
+         if (delayed[slot].due_ms == wheel_tick) {
+            apply_gen_enable(delayed[slot].type, delayed[slot].channel_mask);
+            free_delayed(bucket, prev, slot);
+         } else {
+            prev = slot; // due on a later turn of the wheel
+         }
+         slot = next;
+      }
+   }
+   update_delay_telemetry();
+}
+
+// execute a compiled action, other than ACTION_EXECUTE which is handled by the interpreter
+static inline void execute_action(const compiled_action_t* a) {
+   const uint8_t channel_mask = a->channel_mask;
+   const uint16_t value = a->value;
+
+   switch (a->type) {
+      case ACTION_SET:
+      case ACTION_INCREMENT:
+      case ACTION_DECREMENT: { // set,increment,decrement param+target value for all channels in mask, while keeping it constrained to TARGET_MIN/MAX
+         const param_t param = a->param;
+         const target_t target = a->target;
+
+         uint16_t val = value;
+         for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
+            if (~channel_mask & (1 << ch_index))
+               continue;
+
+            if (a->type == ACTION_INCREMENT) {
+               val = GET_VALUE(ch_index, param, target) + value;
+            } else if (a->type == ACTION_DECREMENT) {
+               val = GET_VALUE(ch_index, param, target) - value;
+            }
+
+            if (target == TARGET_VALUE) { // limit target value between TARGET_MIN and TARGET_MAX
+               const uint16_t min = GET_VALUE(ch_index, param, TARGET_MIN);
+               const uint16_t max = GET_VALUE(ch_index, param, TARGET_MAX);
+
+               if (val > max) {
+                  val = max;
+               } else if (val < min) {
+                  val = min;
+               }
+            }
+
+            SET_VALUE(ch_index, param, target, val);
+         }
+         break;
+      }
+      case ACTION_ENABLE: // enable channel generation for mask, with optional delayed disable in milliseconds
+         apply_gen_enable(ACTION_ENABLE, channel_mask);
+         if (value > 0)
+            schedule_delayed(ACTION_DISABLE, channel_mask, value);
+         break;
+      case ACTION_DISABLE: // disable channel generation for mask, with optional delayed enable in milliseconds
+         apply_gen_enable(ACTION_DISABLE, channel_mask);
+         if (value > 0)
+            schedule_delayed(ACTION_ENABLE, channel_mask, value);
+         break;
+      case ACTION_TOGGLE: // toggle channel generation for mask, with optional delayed toggle in milliseconds
+         apply_gen_enable(ACTION_TOGGLE, channel_mask);
+         if (value > 0)
+            schedule_delayed(ACTION_TOGGLE, channel_mask, value);
+         break;
+      case ACTION_CANCEL: // cancel pending delayed enable/disable/toggle for mask
+         cancel_delayed(channel_mask);
+         break;
+      case ACTION_VAR_SET:
+         set_var(a->var, value);
+         break;
+      case ACTION_VAR_ADD: // value is signed, wraps
+         set_var(a->var, get_var(a->var) + value);
+         break;
+      case ACTION_VAR_COUNT: { // count up, wrapping to 0 at value
+         const uint16_t var = get_var(a->var) + 1;
+         set_var(a->var, (value && var >= value) ? 0 : var);
+         break;
+      }
+      case ACTION_VAR_RANDOM:
+         set_var(a->var, value ? random_below(value) : random_next() >> 16);
+         break;
+      case ACTION_PARAM_UPDATE: // update parameter step/rate using channel mask
+         for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
+            if (channel_mask & (1 << ch_index))
+               parameter_update(ch_index, a->param);
+         }
+         break;
+      default:
+         break;
+   }
+}
+
+// Returns true if running the list would run an action that started a frame still running, recursing forever
+static inline bool is_cycle(const action_frame_t* stack, uint8_t depth, uint8_t start, uint8_t end) {
+   for (uint8_t i = 0; i < depth; i++) {
+      const uint8_t caller = stack[i].caller;
+      if (caller >= start && caller < end)
+         return true;
+   }
+   return false;
+}
+
+// Returns true if the comparison of the variable with the value holds
+static inline bool compare(compare_op_t op, uint16_t var, uint16_t value) {
+   switch (op) {
+      case COMPARE_EQ:
+         return var == value;
+      case COMPARE_NE:
+         return var != value;
+      case COMPARE_LT:
+         return var < value;
+      case COMPARE_LE:
+         return var <= value;
+      case COMPARE_GT:
+         return var > value;
+      case COMPARE_GE:
+         return var >= value;
+      case COMPARE_AND:
+         return var & value;
+      default:
+         return false;
+   }
+}
+
+void execute_action_list(uint8_t al_start, uint8_t al_end) {
+   if (al_start >= al_end)
+      return;
+
+   const uint32_t start_time_us = time_us_32();
+
+   action_frame_t stack[ACTION_MAX_DEPTH];
+   uint8_t depth = 1;
+   stack[0].end = MIN(al_end, MAX_ACTIONS);
+   stack[0].index = al_start;
+
+   uint16_t steps = 0;
+   bool aborted = false;
+
+   while (depth) {
+      action_frame_t* frame = &stack[depth - 1];
+      if (frame->index >= frame->end) {
+         depth--; // list finished, return to the caller
+         continue;
+      }
+
+      if (steps >= ACTION_MAX_STEPS) {
+         aborted = true;
+         break;
+      }
+      steps++;
+
+      const uint8_t a_index = frame->index++;
+      const compiled_action_t* a = &actions[a_index];
+
+      uint8_t start, end;
+      switch (a->type) {
+         case ACTION_EXECUTE: // run another action list from this list
+            start = a->value >> 8; // start:upper byte, end: lower byte
+            end = MIN(a->value & 0xff, MAX_ACTIONS);
+            break;
+         case ACTION_IF: // skip the guarded actions if the comparison fails
+            if (!compare(a->op, get_var(a->var), a->value))
+               frame->index = MIN(frame->index + a->count, frame->end);
+            continue;
+         case ACTION_SELECT: // run one of the following actions, picked by variable
+         case ACTION_SELECT_RANDOM: {
+            const uint8_t count = MIN(a->count, frame->end - frame->index);
+            if (count == 0)
+               continue;
+
+            const uint16_t pick = a->type == ACTION_SELECT ? get_var(a->var) % count : random_below(count);
+            start = frame->index + pick;
+            end = start + 1;
+            frame->index += count;
+            break;
+         }
+         default:
+            execute_action(a);
+            continue;
+      }
+
+      frame->caller = a_index;
+      if (depth >= ACTION_MAX_DEPTH || is_cycle(stack, depth, start, end)) {
+         aborted = true; // skip the nested list, but keep running this one
+         continue;
+      }
+
+      stack[depth].end = end;
+      stack[depth].index = start;
+      depth++;
+   }
+
+   // Report the cost of this execution
+   const uint32_t duration_us = time_us_32() - start_time_us;
+   set_state16(REG_ACTION_STEPS_w, steps);
+   set_state16(REG_ACTION_DURATION_w, MIN(duration_us, UINT16_MAX));
+   if (steps > peak_steps) {
+      peak_steps = steps;
+      set_state16(REG_ACTION_PEAK_STEPS_w, peak_steps);
+   }
+   if (aborted)
+      set_state16(REG_ACTION_ABORTS_w, ++aborts);
+}
@@ -0,0 +1,48 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ACTION_H
+#define _ACTION_H
+
+#include "swx.h"
+
+#ifndef ACTION_MAX_STEPS
+#define ACTION_MAX_STEPS (1024) // max actions run by a single execute_action_list() call, including nested lists
+#endif
+
+#ifndef ACTION_MAX_DEPTH
+#define ACTION_MAX_DEPTH (8) // max nesting of ACTION_EXECUTE lists
+#endif
+
+#ifndef ACTION_DELAY_SLOTS
+#define ACTION_DELAY_SLOTS (32) // max pending delayed channel generation changes (ACTION_ENABLE/DISABLE/TOGGLE with a delay)
+#endif
+
+void actions_init();
+
+// Apply delayed channel generation changes that are due, in due time then schedule order
+void actions_process();
+
+// Recompile actions whose registers changed. Actions are decoded and validated once, invalid actions compile to ACTION_NONE.
+void actions_configure();
+
+// Execute each action between indices al_start and al_end. ACTION_IF skips the actions it guards, and ACTION_SELECT* runs one
+// of the actions following it. Nested lists (ACTION_EXECUTE, ACTION_SELECT*) are run iteratively, stopping at
+// ACTION_MAX_DEPTH, ACTION_MAX_STEPS, or a list that would run the action that started it again.
+void execute_action_list(uint8_t al_start, uint8_t al_end);
+
+#endif // _ACTION_H
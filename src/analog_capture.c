@@ -16,63 +16,318 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "analog_capture.h"
+#include "state.h"
 
 #include <pico/stdlib.h>
 
 #include <hardware/dma.h>
 #include <hardware/irq.h>
+#include <hardware/sync.h>
 
 #include <hardware/adc.h>
 
-#define PIN_ADC_BASE (26)
+#include "util/swar.h"
+
+#ifdef PIN_I2S_SD
+#include <hardware/pio.h>
+#include <hardware/clocks.h>
 
-// The number of analog samples per second per channel. Since 3 ADC channels are being sampled the actual sample rate is 3 times bigger.
-#define ADC_SAMPLES_PER_SECOND (44100)
+#include "i2s_in.pio.h"
+#endif
 
-// Number of ADC channels sampled
-#define ADC_SAMPLED_CHANNELS (3)
+#define PIN_ADC_BASE (26)
 
-#define ADC_CAPTURE_COUNT (1024)                                    // Total samples captured per DMA buffer
-#define ADC_SAMPLE_COUNT (ADC_CAPTURE_COUNT / ADC_SAMPLED_CHANNELS) // Number of samples per ADC channel
+#define ADC_CAPTURE_MAX (ANALOG_VIEW_MAX_COUNT) // Max total samples captured per DMA buffer, shared by all active sources
+
+// Number of capture buffers. DMA is always writing one and has the next armed, while the latest completed buffer and
+// the buffer held by the consumer are never touched.
+#define CAPTURE_SLOTS (4)
+#define SLOT_NONE (0xFF)
+
+#define ADC_CLOCK_MHZ (48)
+#define ADC_CLKDIV_MIN (96)    // 500 ksps, fastest conversion rate
+#define ADC_CLKDIV_MAX (65536) // ~732 sps
+
+#define ADC_SOURCES (ANALOG_SRC_MASK(AUDIO_CHANNEL_MIC) | ANALOG_SRC_MASK(AUDIO_CHANNEL_LEFT) | ANALOG_SRC_MASK(AUDIO_CHANNEL_RIGHT))
+#define I2S_SOURCES (ANALOG_SRC_MASK(AUDIO_CHANNEL_I2S_LEFT) | ANALOG_SRC_MASK(AUDIO_CHANNEL_I2S_RIGHT))
+#define PCM_SOURCES (ANALOG_SRC_MASK(AUDIO_CHANNEL_PCM))
+
+// Default capture config. Mic, left, and right audio at 44.1 kHz, with 341 samples each per buffer (~7.7 ms)
+#define CAPTURE_DEFAULT_SOURCES (ADC_SOURCES)
+#define CAPTURE_DEFAULT_RATE (4410) // 10 Hz units
+#define CAPTURE_DEFAULT_LENGTH (341)
+
+#ifdef PIN_I2S_SD
+#ifndef I2S_PIO
+#define I2S_PIO (pio1) // pio0 is used by the channel pulse generators
+#endif
+
+#define I2S_CAPTURE_MAX_FRAMES (512)
+#define I2S_CAPTURE_MAX (I2S_CAPTURE_MAX_FRAMES * 2) // Max words captured per DMA buffer, left and right slot per frame
+#define I2S_RATE_MIN (800)                           // 8 kHz
+#define I2S_RATE_MAX (9600)                          // 96 kHz
+#endif
+
+// Default I2S config, disabled until enabled in REG_CAPTURE_SRC. 24 bit at 44.1 kHz, with 256 frames per buffer (~5.8 ms)
+#define I2S_DEFAULT_RATE (4410) // 10 Hz units
+#define I2S_DEFAULT_LENGTH (256)
+#define I2S_DEFAULT_BITS (24)
+
+#define PCM_RING_SIZE (4096) // Uploaded samples that can be queued (~1 s at the 100 kHz bus max rate), must be a power of 2
+#define PCM_RING_MASK (PCM_RING_SIZE - 1)
+
+// Uploaded samples share the I2C bus with other register traffic, so the max rate is derived from the bus clock. A sample is
+// 2 bytes of 9 clocks, with ~30% left over for write framing and REG_PCM_FILL_w polling (~4.1 kHz on a 100 kHz bus).
+#define PCM_BUS_CLOCKS_PER_SAMPLE (24)
+#define PCM_RATE_MIN (100) // 1 kHz
+#define PCM_RATE_MAX (MIN(I2C_FREQ_COMMS / (PCM_BUS_CLOCKS_PER_SAMPLE * 10), 9600)) // 10 Hz units, at most 96 kHz on faster buses
+static_assert(PCM_RATE_MAX >= PCM_RATE_MIN);
+
+// Default PCM upload config, disabled until enabled in REG_CAPTURE_SRC. The max rate the bus sustains (up to 44.1 kHz), with
+// 64 samples per buffer (~15 ms at 4.1 kHz)
+#define PCM_DEFAULT_RATE (MIN(PCM_RATE_MAX, 4410)) // 10 Hz units
+#define PCM_DEFAULT_LENGTH (64)
+
+// Ping-pong DMA capture into a ring of slots. Capture times are derived from the number of transfers, since the transfers
+// are paced by a clock (ADC conversions or I2S slots).
+typedef struct {
+   uint dma_ch[2];
+   uint8_t dma_slots[2];             // Slot each DMA channel writes into (index 0: ch1, index 1: ch2)
+
+   uint8_t* buf;                     // CAPTURE_SLOTS consecutive buffers
+   uint32_t slot_size;               // size of each buffer in bytes
+   uint32_t transfer_count;          // transfers per buffer
+   uint32_t transfer_cycles_q8;      // clock cycles per transfer (Q8)
+   uint32_t clock_mhz;
+
+   volatile uint8_t latest_slot;     // Most recently completed slot
+   volatile uint8_t held_slot;       // Slot being read by the consumer
+   volatile uint32_t seq;            // Number of completed buffers since capture init
+   uint32_t slot_seqs[CAPTURE_SLOTS]; // Sequence number of the buffer in each slot
+
+   uint32_t epoch_seq;               // Sequence number when the current config was applied
+   uint64_t start_time_us;           // Time the first transfer of the current config was taken, adjusted for capture stops
+} capture_ring_t;
 
 static void init_pingpong_dma(const uint channel1, const uint channel2, uint dreq, const volatile void* read_addr, volatile void* write_addr1, volatile void* write_addr2,
                               uint transfer_count, enum dma_channel_transfer_size size, uint irq_num, irq_handler_t handler);
 static void dma_channels_abort(uint ch1, uint ch2, uint irq_num);
 static void dma_adc_handler();
 
+static bool capture_running;
+
+static uint32_t fetched_seqs[TOTAL_ANALOG_CHANNELS + 1]; // Last sequence number fetched, indexed by analog channel
+
 // ------------------------------------------------------------------
 // ADC Capture Variables
 // ------------------------------------------------------------------
 
-static uint dma_adc_ch1;
-static uint dma_adc_ch2;
-
-// DMA Ping-Pong Buffers - uint16 since ADC is only 12 bit (~9 ENOB)
-static uint16_t adc_capture_buf[2][ADC_CAPTURE_COUNT] __attribute__((aligned(ADC_CAPTURE_COUNT * sizeof(uint16_t))));
-
-volatile uint8_t buf_adc_ready;
-volatile uint32_t buf_adc_done_time_us;
-
-// ADC consumer buffers, updated on request
-static uint16_t adc_buffers[ADC_SAMPLED_CHANNELS][ADC_SAMPLE_COUNT];
-
-static uint32_t adc_end_time_us; // Cached version of: buf_adc_done_time_us
+// DMA capture buffers - uint16 since ADC is only 12 bit (~9 ENOB)
+static uint16_t adc_capture_buf[CAPTURE_SLOTS][ADC_CAPTURE_MAX];
 
-static const uint32_t adc_capture_duration_us = ADC_CAPTURE_COUNT * (1000000ul / (ADC_SAMPLES_PER_SECOND));
+static capture_ring_t adc_ring;
 
-// Lookup Table: Analog channel -> ADC round robin stripe offset
-static const uint8_t adc_stripe_offsets[] = {
+// Lookup Table: Analog channel -> ADC input
+static const uint8_t adc_inputs[] = {
     [AUDIO_CHANNEL_MIC] = (PIN_AUDIO_MIC - PIN_ADC_BASE),
     [AUDIO_CHANNEL_LEFT] = (PIN_AUDIO_LEFT - PIN_ADC_BASE),
     [AUDIO_CHANNEL_RIGHT] = (PIN_AUDIO_RIGHT - PIN_ADC_BASE),
 };
 
-// Lookup Table: Analog channel -> capture_buf
-static uint16_t* buffers[] = {
-    [AUDIO_CHANNEL_MIC] = adc_buffers[0],
-    [AUDIO_CHANNEL_LEFT] = adc_buffers[1],
-    [AUDIO_CHANNEL_RIGHT] = adc_buffers[2],
-};
+// Applied capture config
+static struct {
+   uint8_t sources;           // active analog channels, see ANALOG_SRC_MASK()
+   uint16_t rate;             // per source sample rate (10 Hz units)
+   uint16_t length;           // samples per source per buffer
+   uint16_t requested_length; // length before the low latency limit, read back by the length register
+   bool low_latency;          // length limited to CAPTURE_LOW_LATENCY_US
+
+   uint8_t input_mask;    // ADC round robin input mask
+   uint8_t input_count;   // number of ADC inputs sampled
+   uint16_t capture_count; // total samples per buffer, multiple of input_count so round robin stays aligned
+   uint32_t clkdiv;       // ADC clock cycles per conversion
+
+   uint8_t stripe_offsets[TOTAL_ANALOG_CHANNELS + 1]; // analog channel -> round robin stripe offset
+} cfg;
+
+// ------------------------------------------------------------------
+// I2S Capture Variables
+// ------------------------------------------------------------------
+
+#ifdef PIN_I2S_SD
+// DMA capture buffers - one word per slot, samples are MSB first in the lower half (16 bit slots) or upper half (32 bit slots)
+static uint32_t i2s_capture_buf[CAPTURE_SLOTS][I2S_CAPTURE_MAX];
+
+static capture_ring_t i2s_ring;
+
+static uint i2s_sm;
+static uint i2s_offset;
+
+static void dma_i2s_handler();
+#endif
+
+// Applied I2S config
+static struct {
+   uint8_t sources;           // active I2S channels, see ANALOG_SRC_MASK()
+   uint16_t rate;             // sample rate (10 Hz units)
+   uint16_t length;           // frames per buffer
+   uint16_t requested_length; // length before the low latency limit
+   uint8_t bits;              // sample bits, 16 or 24 (32 bit slots)
+   bool low_latency;
+} i2s_cfg;
+
+// ------------------------------------------------------------------
+// PCM Upload Variables
+// ------------------------------------------------------------------
+
+static struct {
+   int16_t ring[PCM_RING_SIZE];
+   volatile uint16_t head; // next write index, only written by the I2C handler
+   volatile uint16_t tail; // next read index
+   uint8_t low_byte;       // first byte of a partially written sample
+   bool partial;
+
+   uint16_t buffer[ANALOG_VIEW_MAX_COUNT] __attribute__((aligned(4))); // most recently played buffer, views point here
+   uint32_t seq;                           // number of played buffers since init
+   uint32_t buffer_time_us;                // time the first sample of the buffer was played
+
+   bool playing;
+   uint64_t start_time_us; // time playback started
+   uint32_t position;      // samples played since playback started
+
+   uint16_t underruns;
+   uint16_t overruns;
+} pcm;
+
+// Applied PCM upload config
+static struct {
+   uint8_t sources;           // PCM source enabled, see ANALOG_SRC_MASK()
+   uint16_t rate;             // sample rate (10 Hz units)
+   uint16_t length;           // samples per buffer
+   uint16_t requested_length; // length before the low latency limit
+   bool low_latency;
+} pcm_cfg;
+
+// Convert a count of ring transfers into microseconds. Transfers are paced by the capture clock, so this is exact.
+static inline uint64_t transfers_to_us(const capture_ring_t* ring, uint64_t transfers) {
+   return transfers * ring->transfer_cycles_q8 / (ring->clock_mhz << 8);
+}
+
+// Returns the round robin stripe offset for the ADC input, which is the number of active inputs sampled before it
+static inline uint8_t adc_input_stripe(uint8_t adc_input) {
+   return __builtin_popcount(cfg.input_mask & ((1u << adc_input) - 1));
+}
+
+static inline uint16_t clamp_duration_us(uint64_t duration_us) {
+   return duration_us > UINT16_MAX ? UINT16_MAX : duration_us;
+}
+
+// Returns the length limited to at most CAPTURE_LOW_LATENCY_US of samples at the rate (10 Hz units)
+static inline uint16_t low_latency_length(uint16_t length, uint16_t rate) {
+   uint32_t max_length = (rate * 10ul * CAPTURE_LOW_LATENCY_US) / 1000000ul;
+   if (max_length < 1)
+      max_length = 1;
+   return length > max_length ? max_length : length;
+}
+
+static void ring_init(capture_ring_t* ring, void* buf, uint32_t slot_size) {
+   ring->buf = buf;
+   ring->slot_size = slot_size;
+   ring->latest_slot = SLOT_NONE;
+   ring->held_slot = SLOT_NONE;
+   ring->seq = 0;
+   ring->dma_slots[0] = 0;
+   ring->dma_slots[1] = 1;
+}
+
+static inline void* ring_slot(const capture_ring_t* ring, uint8_t slot) {
+   return ring->buf + slot * ring->slot_size;
+}
+
+// Abort DMA, discarding any partially captured buffer and any previously captured buffers, since they no longer match the config
+static void ring_stop(capture_ring_t* ring) {
+   dma_channels_abort(ring->dma_ch[0], ring->dma_ch[1], DMA_IRQ_0);
+   dma_channel_acknowledge_irq0(ring->dma_ch[0]);
+   dma_channel_acknowledge_irq0(ring->dma_ch[1]);
+
+   ring->latest_slot = SLOT_NONE;
+   ring->held_slot = SLOT_NONE;
+   ring->epoch_seq = ring->seq;
+}
+
+// Arm DMA with the first two slots, DMA starts once the capture clock requests data
+static void ring_start(capture_ring_t* ring, uint32_t transfer_count) {
+   ring->transfer_count = transfer_count;
+   ring->dma_slots[0] = 0;
+   ring->dma_slots[1] = 1;
+   dma_channel_set_trans_count(ring->dma_ch[0], transfer_count, false);
+   dma_channel_set_trans_count(ring->dma_ch[1], transfer_count, false);
+   dma_channel_set_write_addr(ring->dma_ch[1], ring_slot(ring, ring->dma_slots[1]), false);
+   dma_channel_set_irq0_enabled(ring->dma_ch[0], true);
+   dma_channel_set_irq0_enabled(ring->dma_ch[1], true);
+   dma_channel_set_write_addr(ring->dma_ch[0], ring_slot(ring, ring->dma_slots[0]), true); // start channel 1
+}
+
+// Returns the number of transfers since the current config was applied
+static uint64_t ring_transfers(const capture_ring_t* ring) {
+   const uint32_t irq = save_and_disable_interrupts();
+
+   const uint active = dma_channel_is_busy(ring->dma_ch[1]) ? ring->dma_ch[1] : ring->dma_ch[0];
+   const uint64_t count = (uint64_t)(ring->seq - ring->epoch_seq) * ring->transfer_count + (ring->transfer_count - dma_channel_hw_addr(active)->transfer_count);
+
+   restore_interrupts(irq);
+   return count;
+}
+
+static inline void ring_complete(capture_ring_t* ring, uint8_t index) {
+   const uint8_t done_slot = ring->dma_slots[index];
+   const uint8_t writing_slot = ring->dma_slots[index ^ 1]; // other channel was started by chaining
+
+   ring->slot_seqs[done_slot] = ++ring->seq;
+   ring->latest_slot = done_slot;
+
+   // Arm finished channel with a slot that isn't being written, the latest, or held by the consumer
+   uint8_t next = done_slot;
+   do {
+      next = (next + 1) % CAPTURE_SLOTS;
+   } while (next == writing_slot || next == done_slot || next == ring->held_slot);
+
+   ring->dma_slots[index] = next;
+   dma_channel_set_write_addr(ring->dma_ch[index], ring_slot(ring, next), false);
+}
+
+static inline void ring_irq(capture_ring_t* ring) {
+   if (dma_channel_get_irq0_status(ring->dma_ch[0])) {
+      ring_complete(ring, 0);
+      dma_channel_acknowledge_irq0(ring->dma_ch[0]);
+   } else if (dma_channel_get_irq0_status(ring->dma_ch[1])) {
+      ring_complete(ring, 1);
+      dma_channel_acknowledge_irq0(ring->dma_ch[1]);
+   }
+}
+
+// Take hold of the latest slot, so DMA won't be armed with it until the next fetch. Returns SLOT_NONE if nothing is captured.
+static inline uint8_t ring_hold(capture_ring_t* ring) {
+   const uint32_t irq = save_and_disable_interrupts();
+   const uint8_t slot = ring->latest_slot;
+   ring->held_slot = slot;
+   restore_interrupts(irq);
+   return slot;
+}
+
+// Registers read back the applied sources of ADC, I2S and PCM upload
+static inline void write_capture_sources() {
+   set_state(REG_CAPTURE_SRC, cfg.sources | i2s_cfg.sources | pcm_cfg.sources);
+}
+
+// Convert a count of PCM samples into microseconds
+static inline uint64_t pcm_samples_to_us(uint64_t samples) {
+   return samples * 100000ull / pcm_cfg.rate; // rate is in 10 Hz units
+}
+
+static inline uint16_t pcm_fill() {
+   return (pcm.head - pcm.tail) & PCM_RING_MASK;
+}
 
 void analog_capture_init() {
    LOG_DEBUG("Init analog capture...\n");
@@ -83,8 +338,6 @@ void analog_capture_init() {
 
    LOG_DEBUG("Init internal ADC...\n");
    adc_init();
-   adc_select_input(0);
-   adc_set_round_robin((1 << (PIN_AUDIO_LEFT - PIN_ADC_BASE)) | (1 << (PIN_AUDIO_RIGHT - PIN_ADC_BASE)) | (1 << (PIN_AUDIO_MIC - PIN_ADC_BASE)));
 
    adc_fifo_setup(true,  // Write each completed conversion to the sample FIFO
                   true,  // Enable DMA data request (DREQ)
@@ -93,81 +346,450 @@ void analog_capture_init() {
                   false  // Don't reduce samples
    );
 
-   static const uint32_t div = 48000000ul / (ADC_SAMPLES_PER_SECOND * ADC_SAMPLED_CHANNELS);
-   adc_set_clkdiv(div - 1);
+   // Setup ping-pong DMA for ADC FIFO writing into the capture slots, the handler re-arms each channel with a free slot once finished
+   ring_init(&adc_ring, adc_capture_buf, sizeof(adc_capture_buf[0]));
+   adc_ring.clock_mhz = ADC_CLOCK_MHZ;
 
-   // Setup ping-pong DMA for ADC FIFO writing to adc_capture_buf, wrapping once filled
-   dma_adc_ch1 = dma_claim_unused_channel(true);
-   dma_adc_ch2 = dma_claim_unused_channel(true);
-   init_pingpong_dma(dma_adc_ch1, dma_adc_ch2, DREQ_ADC, &adc_hw->fifo, adc_capture_buf[0], adc_capture_buf[1], ADC_CAPTURE_COUNT, DMA_SIZE_16, DMA_IRQ_0,
+   adc_ring.dma_ch[0] = dma_claim_unused_channel(true);
+   adc_ring.dma_ch[1] = dma_claim_unused_channel(true);
+   init_pingpong_dma(adc_ring.dma_ch[0], adc_ring.dma_ch[1], DREQ_ADC, &adc_hw->fifo, adc_capture_buf[0], adc_capture_buf[1], ADC_CAPTURE_MAX, DMA_SIZE_16, DMA_IRQ_0,
                      dma_adc_handler);
 
-   // Start channel 1
-   buf_adc_ready = 0;
-   dma_channel_start(dma_adc_ch1);
+#ifdef PIN_I2S_SD
+   LOG_DEBUG("Init I2S...\n");
+   i2s_sm = pio_claim_unused_sm(I2S_PIO, true);
+   i2s_offset = pio_add_program(I2S_PIO, &i2s_in_program);
+
+   // Setup ping-pong DMA for the I2S PIO RX FIFO, same as ADC
+   ring_init(&i2s_ring, i2s_capture_buf, sizeof(i2s_capture_buf[0]));
+   i2s_ring.clock_mhz = clock_get_hz(clk_sys) / 1000000ul;
+
+   i2s_ring.dma_ch[0] = dma_claim_unused_channel(true);
+   i2s_ring.dma_ch[1] = dma_claim_unused_channel(true);
+   init_pingpong_dma(i2s_ring.dma_ch[0], i2s_ring.dma_ch[1], pio_get_dreq(I2S_PIO, i2s_sm, false), &I2S_PIO->rxf[i2s_sm], i2s_capture_buf[0], i2s_capture_buf[1],
+                     I2S_CAPTURE_MAX, DMA_SIZE_32, DMA_IRQ_0, dma_i2s_handler);
+#endif
+
+   // Apply default config, which also starts the DMA
+   analog_capture_configure(CAPTURE_DEFAULT_SOURCES, CAPTURE_DEFAULT_RATE, CAPTURE_DEFAULT_LENGTH, false);
+   analog_capture_configure_i2s(0, I2S_DEFAULT_RATE, I2S_DEFAULT_LENGTH, I2S_DEFAULT_BITS, false);
+   analog_capture_configure_pcm(0, PCM_DEFAULT_RATE, PCM_DEFAULT_LENGTH, false);
+}
+
+void analog_capture_configure(uint8_t sources, uint16_t rate, uint16_t length, bool low_latency) {
+   sources &= ADC_SOURCES; // drop unknown sources and I2S sources (see analog_capture_configure_i2s)
+
+   if (sources == cfg.sources && rate == cfg.rate && length == cfg.requested_length && low_latency == cfg.low_latency)
+      return; // nothing changed
+
+   uint8_t input_mask = 0;
+   for (analog_channel_t channel = AUDIO_CHANNEL_MIC; channel <= AUDIO_CHANNEL_RIGHT; channel++) {
+      if (sources & ANALOG_SRC_MASK(channel))
+         input_mask |= 1 << adc_inputs[channel];
+   }
+   const uint8_t input_count = __builtin_popcount(input_mask);
+   uint16_t requested_length = length;
+
+   if (input_count) {
+      // Clamp rate and length to what the ADC and capture buffers support
+      const uint32_t total_rate = (rate ? rate : 1) * 10ul * input_count;
+      uint32_t clkdiv = (ADC_CLOCK_MHZ * 1000000ul) / total_rate;
+      if (clkdiv < ADC_CLKDIV_MIN)
+         clkdiv = ADC_CLKDIV_MIN;
+      else if (clkdiv > ADC_CLKDIV_MAX)
+         clkdiv = ADC_CLKDIV_MAX;
+      rate = (ADC_CLOCK_MHZ * 1000000ul) / (clkdiv * 10ul * input_count);
+
+      const uint16_t max_length = ADC_CAPTURE_MAX / input_count;
+      if (length == 0)
+         length = 1;
+      else if (length > max_length)
+         length = max_length;
+
+      requested_length = length;
+      if (low_latency)
+         length = low_latency_length(length, rate);
+
+      cfg.clkdiv = clkdiv;
+   }
+
+   LOG_INFO("Capture config: sources=0x%02x rate=%luHz length=%u\n", sources, rate * 10ul, length);
+
+   // Stop capture and DMA, discarding any partially captured buffer
+   adc_run(false);
+   ring_stop(&adc_ring);
+   adc_fifo_drain();
+
+   cfg.sources = sources;
+   cfg.rate = rate;
+   cfg.length = length;
+   cfg.requested_length = requested_length;
+   cfg.low_latency = low_latency;
+   cfg.input_mask = input_mask;
+   cfg.input_count = input_count;
+   cfg.capture_count = length * input_count;
+   for (analog_channel_t channel = AUDIO_CHANNEL_MIC; channel <= AUDIO_CHANNEL_RIGHT; channel++)
+      cfg.stripe_offsets[channel] = adc_input_stripe(adc_inputs[channel]);
+   adc_ring.transfer_cycles_q8 = cfg.clkdiv << 8;
+
+   // Registers read back the applied (clamped) config, except length keeps the requested value so leaving low latency mode
+   // restores it. The duration reflects the effective length.
+   write_capture_sources();
+   set_state16(REG_CAPTURE_RATE_w, rate);
+   set_state16(REG_CAPTURE_LENGTH_w, requested_length);
+   set_state16(REG_CAPTURE_DURATION_w, input_count ? clamp_duration_us(transfers_to_us(&adc_ring, cfg.capture_count)) : 0);
+
+   if (!input_count)
+      return; // no sources, leave capture stopped
+
+   // Round robin starts at the lowest active input
+   adc_select_input(__builtin_ctz(input_mask));
+   adc_set_round_robin(input_count > 1 ? input_mask : 0);
+   adc_set_clkdiv(cfg.clkdiv - 1);
+
+   ring_start(&adc_ring, cfg.capture_count);
+
+   if (capture_running) {
+      adc_ring.start_time_us = time_us_64();
+      adc_run(true);
+   }
+}
+
+void analog_capture_configure_i2s(uint8_t sources, uint16_t rate, uint16_t length, uint8_t bits, bool low_latency) {
+#ifdef PIN_I2S_SD
+   sources &= I2S_SOURCES;
+
+   // Clamp to what the PIO program and capture buffers support
+   bits = bits > 16 ? 24 : 16;
+   if (rate < I2S_RATE_MIN)
+      rate = I2S_RATE_MIN;
+   else if (rate > I2S_RATE_MAX)
+      rate = I2S_RATE_MAX;
+   if (length == 0)
+      length = 1;
+   else if (length > I2S_CAPTURE_MAX_FRAMES)
+      length = I2S_CAPTURE_MAX_FRAMES;
+   const uint16_t requested_length = length;
+   if (low_latency)
+      length = low_latency_length(length, rate);
+
+   if (sources == i2s_cfg.sources && rate == i2s_cfg.rate && requested_length == i2s_cfg.requested_length && bits == i2s_cfg.bits && low_latency == i2s_cfg.low_latency)
+      return; // nothing changed
+
+   // Two PIO instructions per bit clock, fractional clock divider (Q8)
+   const uint32_t slot_bits = bits > 16 ? 32 : 16;
+   const uint32_t cycles_per_frame = 2 * 2 * slot_bits;
+   const uint32_t div_q8 = ((uint64_t)i2s_ring.clock_mhz * 1000000ull << 8) / (rate * 10ul * cycles_per_frame);
+   rate = ((uint64_t)i2s_ring.clock_mhz * 1000000ull << 8) / ((uint64_t)div_q8 * cycles_per_frame * 10);
+
+   LOG_INFO("I2S config: sources=0x%02x rate=%luHz length=%u bits=%u\n", sources, rate * 10ul, length, bits);
+
+   // Stop capture and DMA, discarding any partially captured buffer
+   pio_sm_set_enabled(I2S_PIO, i2s_sm, false);
+   ring_stop(&i2s_ring);
+   pio_sm_clear_fifos(I2S_PIO, i2s_sm);
+
+   i2s_cfg.sources = sources;
+   i2s_cfg.rate = rate;
+   i2s_cfg.length = length;
+   i2s_cfg.requested_length = requested_length;
+   i2s_cfg.bits = bits;
+   i2s_cfg.low_latency = low_latency;
+   i2s_ring.transfer_cycles_q8 = div_q8 * slot_bits * 2; // one transfer per slot
+
+   // Registers read back the applied (clamped) config, keeping the requested length like analog_capture_configure()
+   write_capture_sources();
+   set_state16(REG_I2S_RATE_w, rate);
+   set_state16(REG_I2S_LENGTH_w, requested_length);
+   set_state(REG_I2S_BITS, bits);
+   set_state16(REG_I2S_DURATION_w, sources ? clamp_duration_us(transfers_to_us(&i2s_ring, length * 2)) : 0);
+
+   if (!sources)
+      return; // no sources, leave capture stopped
+
+   i2s_in_program_init(I2S_PIO, i2s_sm, i2s_offset, PIN_I2S_BCLK, PIN_I2S_WS, PIN_I2S_SD, slot_bits, div_q8 >> 8, div_q8 & 0xFF);
+
+   ring_start(&i2s_ring, length * 2);
+
+   if (capture_running) {
+      i2s_ring.start_time_us = time_us_64();
+      pio_sm_set_enabled(I2S_PIO, i2s_sm, true);
+   }
+#else
+   // No I2S pins, keep the registers reading back disabled
+   i2s_cfg.sources = 0;
+   i2s_cfg.rate = rate;
+   i2s_cfg.length = length;
+   i2s_cfg.requested_length = length;
+   i2s_cfg.bits = bits;
+   i2s_cfg.low_latency = low_latency;
+   write_capture_sources();
+#endif
+}
+
+void analog_capture_configure_pcm(uint8_t sources, uint16_t rate, uint16_t length, bool low_latency) {
+   sources &= PCM_SOURCES;
+
+   if (rate < PCM_RATE_MIN)
+      rate = PCM_RATE_MIN;
+   else if (rate > PCM_RATE_MAX)
+      rate = PCM_RATE_MAX;
+   if (length == 0)
+      length = 1;
+   else if (length > ANALOG_VIEW_MAX_COUNT)
+      length = ANALOG_VIEW_MAX_COUNT;
+   const uint16_t requested_length = length;
+   if (low_latency)
+      length = low_latency_length(length, rate);
+
+   if (sources == pcm_cfg.sources && rate == pcm_cfg.rate && requested_length == pcm_cfg.requested_length && low_latency == pcm_cfg.low_latency)
+      return; // nothing changed
+
+   LOG_INFO("PCM upload config: sources=0x%02x rate=%luHz length=%u\n", sources, rate * 10ul, length);
+
+   // Discard queued samples, since they may not match the config
+   const uint32_t irq = save_and_disable_interrupts();
+   pcm.head = 0;
+   pcm.tail = 0;
+   pcm.partial = false;
+   pcm_cfg.sources = sources;
+   restore_interrupts(irq);
+
+   pcm.playing = false;
+   pcm_cfg.rate = rate;
+   pcm_cfg.length = length;
+   pcm_cfg.requested_length = requested_length;
+   pcm_cfg.low_latency = low_latency;
+
+   // Registers read back the applied (clamped) config, keeping the requested length like analog_capture_configure()
+   write_capture_sources();
+   set_state16(REG_PCM_RATE_w, rate);
+   set_state16(REG_PCM_LENGTH_w, requested_length);
+   set_state16(REG_PCM_FILL_w, 0);
+}
+
+void __not_in_flash_func(analog_capture_pcm_write)(uint8_t value) {
+   if (!pcm_cfg.sources)
+      return; // upload disabled
+
+   if (!pcm.partial) {
+      pcm.low_byte = value;
+      pcm.partial = true;
+      return;
+   }
+   pcm.partial = false;
+
+   const uint16_t head = pcm.head;
+   const uint16_t next = (head + 1) & PCM_RING_MASK;
+   if (next == pcm.tail) {
+      set_state16(REG_PCM_OVERRUNS_w, ++pcm.overruns); // ring full, drop sample
+      return;
+   }
+
+   pcm.ring[head] = (int16_t)(pcm.low_byte | (value << 8));
+   pcm.head = next;
+   set_state16(REG_PCM_FILL_w, pcm_fill());
+}
+
+void __not_in_flash_func(analog_capture_pcm_end_write)() {
+   pcm.partial = false;
+}
+
+// Play the next buffer once the device clock reaches its end, so uploaded samples are timed as if they were captured.
+// Playback starts once a buffer worth of samples is queued, and restarts after an underrun.
+static void pcm_play() {
+   const uint16_t length = pcm_cfg.length;
+   const uint16_t fill = pcm_fill();
+   const uint64_t now = time_us_64();
+
+   if (!pcm.playing) {
+      if (fill < length)
+         return; // wait for a full buffer
+
+      pcm.playing = true;
+      pcm.start_time_us = now;
+      pcm.position = 0;
+   }
+
+   const uint64_t duration_us = pcm_samples_to_us(length);
+   uint64_t end_time_us = pcm.start_time_us + pcm_samples_to_us(pcm.position + length);
+   if (now < end_time_us)
+      return; // buffer still playing
+
+   if (fill < length) {
+      set_state16(REG_PCM_UNDERRUNS_w, ++pcm.underruns);
+      pcm.playing = false;
+      return;
+   }
+
+   // If buffers weren't fetched in time, restart the timeline so samples aren't timed in the past
+   if (now >= end_time_us + duration_us) {
+      pcm.start_time_us = now - duration_us;
+      pcm.position = 0;
+   }
+
+   const uint16_t tail = pcm.tail;
+   for (uint16_t i = 0; i < length; i++)
+      pcm.buffer[i] = pcm.ring[(tail + i) & PCM_RING_MASK];
+   pcm.tail = (tail + length) & PCM_RING_MASK;
+
+   pcm.buffer_time_us = pcm.start_time_us + pcm_samples_to_us(pcm.position);
+   pcm.position += length;
+   pcm.seq++;
+
+   set_state16(REG_PCM_FILL_w, pcm_fill());
 }
 
 void analog_capture_start() {
    LOG_INFO("Starting analog capture...\n");
-   adc_run(true);
+   capture_running = true;
+
+   // Capture timestamps are derived from the number of transfers, so offset the start time by any already captured
+   if (cfg.input_count) {
+      adc_ring.start_time_us = time_us_64() - transfers_to_us(&adc_ring, ring_transfers(&adc_ring));
+      adc_run(true);
+   }
+
+#ifdef PIN_I2S_SD
+   if (i2s_cfg.sources) {
+      i2s_ring.start_time_us = time_us_64() - transfers_to_us(&i2s_ring, ring_transfers(&i2s_ring));
+      pio_sm_set_enabled(I2S_PIO, i2s_sm, true);
+   }
+#endif
 }
 
 void analog_capture_stop() {
    LOG_INFO("Stopping analog capture...\n");
+   capture_running = false;
    adc_run(false);
+
+#ifdef PIN_I2S_SD
+   pio_sm_set_enabled(I2S_PIO, i2s_sm, false);
+#endif
 }
 
 static void __not_in_flash_func(dma_adc_handler)() {
-   if (dma_channel_get_irq0_status(dma_adc_ch1)) {
-      adc_select_input(0);
-
-      buf_adc_ready = 0xFE; // lookup index: 0
-      buf_adc_done_time_us = time_us_32();
-
-      dma_channel_acknowledge_irq0(dma_adc_ch1);
-   } else if (dma_channel_get_irq0_status(dma_adc_ch2)) {
-      adc_select_input(0);
-
-      buf_adc_ready = 0xFF; // lookup index: 1
-      buf_adc_done_time_us = time_us_32();
+   ring_irq(&adc_ring);
+}
 
-      dma_channel_acknowledge_irq0(dma_adc_ch2);
-   }
+#ifdef PIN_I2S_SD
+static void __not_in_flash_func(dma_i2s_handler)() {
+   ring_irq(&i2s_ring);
 }
+#endif
+
+bool fetch_analog_buffer(analog_channel_t channel, analog_view_t* view, uint32_t* capture_end_time_us) {
+   capture_ring_t* ring = NULL;
+   uint8_t stripe = 0;          // index of the channel's first transfer in the buffer
+   uint8_t transfers = 1;       // transfers per sample of the channel
+   uint8_t data_offset = 0;     // index of the channel's first sample in the buffer (uint16_t units)
+   uint8_t stride = 1;          // distance between samples of the channel (uint16_t units)
+   uint16_t count = 0;
+   analog_format_t format = ANALOG_FORMAT_ADC12;
 
-bool fetch_analog_buffer(analog_channel_t channel, uint16_t* samples, uint16_t** buffer, uint32_t* capture_end_time_us) {
    switch (channel) {
       case AUDIO_CHANNEL_LEFT:
       case AUDIO_CHANNEL_RIGHT:
-      case AUDIO_CHANNEL_MIC: {
-         const uint8_t ready = buf_adc_ready; // Local copy, since volatile
+      case AUDIO_CHANNEL_MIC:
+         if (!(cfg.sources & ANALOG_SRC_MASK(channel)))
+            break; // source not captured
+
+         // Channel samples are a stripe within the interleaved round robin capture buffer
+         ring = &adc_ring;
+         stripe = cfg.stripe_offsets[channel];
+         transfers = cfg.input_count;
+         data_offset = stripe;
+         stride = cfg.input_count;
+         count = cfg.length;
+         break;
+#ifdef PIN_I2S_SD
+      case AUDIO_CHANNEL_I2S_LEFT:
+      case AUDIO_CHANNEL_I2S_RIGHT:
+         if (!(i2s_cfg.sources & ANALOG_SRC_MASK(channel)))
+            break; // source not captured
+
+         // Frames are a left then right slot word, samples are the most significant 16 bits of the slot
+         ring = &i2s_ring;
+         stripe = channel == AUDIO_CHANNEL_I2S_RIGHT;
+         transfers = 2;
+         data_offset = stripe * 2 + (i2s_cfg.bits > 16);
+         stride = 4;
+         count = i2s_cfg.length;
+         format = ANALOG_FORMAT_PCM16;
+         break;
+#endif
+      case AUDIO_CHANNEL_PCM:
+         if (!(pcm_cfg.sources & ANALOG_SRC_MASK(channel)))
+            break; // source not enabled
+
+         pcm_play();
+         if (pcm.seq == 0)
+            break; // nothing played yet
 
          // Check if this channel has new or unprocessed buffer data available
-         const bool available = ready & (1 << channel);
-         if (available) {
-            const uint16_t* src = adc_capture_buf[ready & 1];   // Source DMA buffer
-            const uint8_t offset = adc_stripe_offsets[channel]; // ADC round robin offset
+         const bool available = pcm.seq != fetched_seqs[channel];
+         fetched_seqs[channel] = pcm.seq;
+
+         view->data = pcm.buffer;
+         view->stride = 1;
+         view->format = ANALOG_FORMAT_PCM16;
+         view->count = pcm_cfg.length;
+         view->seq = pcm.seq;
+         view->start_time_us = pcm.buffer_time_us;
+         view->sample_period_q8 = (100000ul << 8) / pcm_cfg.rate;
+
+         *capture_end_time_us = pcm.buffer_time_us + pcm_samples_to_us(pcm_cfg.length);
+         return available;
+      default:
+         break;
+   }
 
-            // Unravel interleaved capture buffer, and shift from 12 bit samples to 10 bit
-            for (uint x = 0; x < ADC_SAMPLE_COUNT; x++)
-               buffers[channel][x] = (src[(x * ADC_SAMPLED_CHANNELS) + offset] & 0xFFF) >> 2;
+   const uint8_t slot = ring ? ring_hold(ring) : SLOT_NONE;
+   if (slot == SLOT_NONE) {
+      *capture_end_time_us = 0;
+      view->data = NULL;
+      view->stride = 0;
+      view->format = ANALOG_FORMAT_ADC12;
+      view->count = 0;
+      view->seq = 0;
+      view->start_time_us = 0;
+      view->sample_period_q8 = 0;
+      return false;
+   }
 
-            adc_end_time_us = buf_adc_done_time_us; // Cache done time
+   const uint32_t seq = ring->slot_seqs[slot];
 
-            buf_adc_ready &= ~(1 << channel);       // Clear flag
-         }
+   // Check if this channel has new or unprocessed buffer data available
+   const bool available = seq != fetched_seqs[channel];
+   fetched_seqs[channel] = seq;
 
-         *capture_end_time_us = adc_end_time_us;
-         *buffer = buffers[channel];
-         *samples = ADC_SAMPLE_COUNT;
-         return available;
-      }
-      default:
-         *capture_end_time_us = 0;
-         *buffer = NULL;
-         *samples = 0;
-         return false;
+   // Point view at the channel samples within the capture buffer
+   view->data = (const uint16_t*)ring_slot(ring, slot) + data_offset;
+   view->stride = stride;
+   view->format = format;
+   view->count = count;
+   view->seq = seq;
+
+   // Derive sample times from the transfer count, the buffer holds transfers [n * count, (n + 1) * count) of the current config
+   const uint64_t first_transfer = (uint64_t)(seq - ring->epoch_seq - 1) * ring->transfer_count;
+   view->start_time_us = ring->start_time_us + transfers_to_us(ring, first_transfer + stripe);
+   view->sample_period_q8 = ((uint64_t)ring->transfer_cycles_q8 * transfers) / ring->clock_mhz;
+
+   *capture_end_time_us = ring->start_time_us + transfers_to_us(ring, first_transfer + ring->transfer_count);
+   return available;
+}
+
+void analog_view_read(const analog_view_t* view, uint16_t index, uint16_t count, uint16_t* dst) {
+   const uint16_t* src = view->data + index * view->stride;
+   if (view->stride != 1) {
+      swar_gather(dst, src, count, view->stride);
+      src = dst; // convert in place
    }
+
+   if (view->format == ANALOG_FORMAT_PCM16)
+      swar_pcm16_to_u16(dst, src, count);
+   else
+      swar_adc12_to_u16(dst, src, count);
 }
 
 uint32_t get_capture_duration_us(analog_channel_t channel) {
@@ -175,24 +797,53 @@ uint32_t get_capture_duration_us(analog_channel_t channel) {
       case AUDIO_CHANNEL_LEFT:
       case AUDIO_CHANNEL_RIGHT:
       case AUDIO_CHANNEL_MIC:
-         return adc_capture_duration_us;
+         if (cfg.sources & ANALOG_SRC_MASK(channel))
+            return transfers_to_us(&adc_ring, cfg.capture_count);
+         return 1;
+#ifdef PIN_I2S_SD
+      case AUDIO_CHANNEL_I2S_LEFT:
+      case AUDIO_CHANNEL_I2S_RIGHT:
+         if (i2s_cfg.sources & ANALOG_SRC_MASK(channel))
+            return transfers_to_us(&i2s_ring, i2s_cfg.length * 2);
+         return 1;
+#endif
+      case AUDIO_CHANNEL_PCM:
+         if (pcm_cfg.sources)
+            return pcm_samples_to_us(pcm_cfg.length);
+         return 1;
       default:
          return 1;
    }
 }
 
-static inline uint32_t log2i(uint32_t n) {
-   uint32_t level = 0;
-   while (n >>= 1)
-      level++;
-   return level;
+bool analog_capture_latest(uint8_t adc_input, uint16_t* counts) {
+   if (!(cfg.input_mask & (1 << adc_input)))
+      return false; // input isn't being captured
+
+   const uint8_t stripe = adc_input_stripe(adc_input);
+   const uint8_t stride = cfg.input_count;
+
+   // Find the slot being written, and the index of the next sample to be written
+   const uint active = dma_channel_is_busy(adc_ring.dma_ch[1]) ? adc_ring.dma_ch[1] : adc_ring.dma_ch[0];
+   const uint32_t written = ((const uint16_t*)dma_hw->ch[active].write_addr) - &adc_capture_buf[0][0];
+   uint8_t slot = written / ADC_CAPTURE_MAX;
+   int32_t index = written % ADC_CAPTURE_MAX;
+
+   // Step back to the last written sample with a matching round robin stripe, using the end of the latest completed slot if needed
+   index -= 1 + ((index - 1 - stripe) % stride + stride) % stride;
+   if (index < 0 || slot >= CAPTURE_SLOTS) {
+      slot = adc_ring.latest_slot;
+      if (slot == SLOT_NONE)
+         return false;
+      index = (cfg.length - 1) * stride + stripe;
+   }
+
+   *counts = adc_capture_buf[slot][index] & 0xFFF;
+   return true;
 }
 
 static void init_pingpong_dma(const uint channel1, const uint channel2, uint dreq, const volatile void* read_addr, volatile void* write_addr1, volatile void* write_addr2,
                               uint transfer_count, enum dma_channel_transfer_size size, uint irq_num, irq_handler_t handler) {
-   // Ring bit must be log2 of total bytes transferred
-   const uint32_t ring_bit = log2i(transfer_count * (size == DMA_SIZE_32 ? 4 : (size == DMA_SIZE_16 ? 2 : 1)));
-
    // Channel 1
    dma_channel_config c1 = dma_channel_get_default_config(channel1);
    channel_config_set_transfer_data_size(&c1, size);
@@ -200,7 +851,6 @@ static void init_pingpong_dma(const uint channel1, const uint channel2, uint dre
    channel_config_set_read_increment(&c1, false); // read_addr
    channel_config_set_write_increment(&c1, true); // write_addr1
 
-   channel_config_set_ring(&c1, true, ring_bit);  // Wrap write addr every n bits
    channel_config_set_dreq(&c1, dreq);
 
    channel_config_set_chain_to(&c1, channel2); // Start channel 2 once finshed
@@ -220,7 +870,6 @@ static void init_pingpong_dma(const uint channel1, const uint channel2, uint dre
    channel_config_set_read_increment(&c2, false); // read_addr
    channel_config_set_write_increment(&c2, true); // write_addr2
 
-   channel_config_set_ring(&c2, true, ring_bit);  // Wrap write addr every n bits
    channel_config_set_dreq(&c2, dreq);
 
    channel_config_set_chain_to(&c2, channel1); // Start channel 1 once finshed
@@ -22,13 +22,81 @@
 
 #include "channel.h"
 
+#define ANALOG_VIEW_MAX_COUNT (1024) // Max samples in a view
+
+#ifndef CAPTURE_LOW_LATENCY_US
+#define CAPTURE_LOW_LATENCY_US (1000) // Max capture buffer duration in low latency mode
+#endif
+
+typedef enum {
+   ANALOG_FORMAT_ADC12 = 0, // 12 bit unsigned internal ADC samples
+   ANALOG_FORMAT_PCM16,     // 16 bit signed PCM samples (most significant bits of I2S samples)
+} analog_format_t;
+
+// Read-only view of the captured samples of a single analog channel. Samples are left in the interleaved DMA capture buffer,
+// so consecutive samples are stride elements apart. Use analog_view_sample() to read a sample.
+typedef struct {
+   const uint16_t* data;
+   uint16_t count;             // number of samples in view
+   uint8_t stride;             // distance between consecutive samples in data
+   analog_format_t format;
+
+   uint32_t seq;               // capture sequence number, increments for every completed capture buffer
+   uint32_t start_time_us;     // time the first sample was taken
+   uint32_t sample_period_q8;  // time between consecutive samples in microseconds (Q8 fixed point)
+} analog_view_t;
+
+// Returns the 16-bit sample at the given index of the view, PCM samples are offset so silence is mid-scale like the ADC.
+// Every format is left justified to 16 bits, so no source loses resolution (see analog_channel_t).
+static inline uint16_t analog_view_sample(const analog_view_t* view, uint16_t index) {
+   if (view->format == ANALOG_FORMAT_PCM16)
+      return view->data[index * view->stride] ^ 0x8000;      // signed 16 bit to offset binary
+   return (view->data[index * view->stride] & 0xFFF) << 4; // 12 bit ADC samples, shift to 16 bit
+}
+
+// Copy count 16-bit samples from the view into dst, starting at index. Same samples as analog_view_sample(), but gathered and
+// converted two at a time, so prefer this when processing a run of samples. dst should be word aligned.
+void analog_view_read(const analog_view_t* view, uint16_t index, uint16_t count, uint16_t* dst);
+
+// Returns the time the sample at the given index of the view was taken
+static inline uint32_t analog_view_sample_time_us(const analog_view_t* view, uint16_t index) {
+   return view->start_time_us + ((index * view->sample_period_q8) >> 8);
+}
+
 void analog_capture_init();
 
+// Reconfigure capture. Sources is a mask of analog channels (see ANALOG_SRC_MASK), rate is the per source sample rate in 10 Hz units,
+// and length is the number of samples per source in each capture buffer. Values are clamped to what the hardware supports,
+// with the applied config written back to the capture registers. Does nothing if the config hasn't changed.
+// In low latency mode, buffers are also limited to CAPTURE_LOW_LATENCY_US. The length register keeps the requested length,
+// so the original buffers are restored when low latency mode is turned off.
+void analog_capture_configure(uint8_t sources, uint16_t rate, uint16_t length, bool low_latency);
+
+// Reconfigure I2S capture, like analog_capture_configure(). Only the I2S bits of sources are used, rate is in 10 Hz units,
+// length is the number of frames in each capture buffer and bits is 16 or 24. Does nothing on boards without I2S pins.
+void analog_capture_configure_i2s(uint8_t sources, uint16_t rate, uint16_t length, uint8_t bits, bool low_latency);
+
+// Reconfigure host PCM upload, like analog_capture_configure(). Only the PCM bit of sources is used, rate is in 10 Hz units and
+// length is the number of samples in each buffer. Queued samples are discarded when the config changes.
+void analog_capture_configure_pcm(uint8_t sources, uint16_t rate, uint16_t length, bool low_latency);
+
+// Append a byte of uploaded PCM sample data (signed 16 bit, little endian). Called from the I2C handler.
+void analog_capture_pcm_write(uint8_t value);
+
+// End of an uploaded PCM write, dropping any incomplete sample. Called from the I2C handler.
+void analog_capture_pcm_end_write();
+
 void analog_capture_start();
 void analog_capture_stop();
 
-bool fetch_analog_buffer(analog_channel_t channel, uint16_t* samples, uint16_t** buffer, uint32_t* capture_end_time_us);
+// Get a view of the most recently captured buffer for the channel. Returns true if the buffer hasn't been fetched before for this channel.
+// No samples are copied, the view points into the DMA buffer which won't be overwritten until the next call to this function.
+// Capture times are derived from the number of samples converted, not from when the buffer was handed over.
+bool fetch_analog_buffer(analog_channel_t channel, analog_view_t* view, uint32_t* capture_end_time_us);
 
 uint32_t get_capture_duration_us(analog_channel_t channel);
 
+// Get the most recent raw 12-bit sample for the given ADC input (0-3). Returns false if the input isn't being captured.
+bool analog_capture_latest(uint8_t adc_input, uint16_t* counts);
+
 #endif // _ANALOG_CAPTURE_H
\ No newline at end of file
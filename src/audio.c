@@ -18,124 +18,690 @@
 /*
  * Based on https://github.com/CrashOverride85/zc95/blob/c67a58668be187b63eeebab66ec8583b33494d43/source/zc95/AudioInput/CAudio3Process.cpp
  * Changes: Add support for swx channel parameter system. Allow adjustment of the pulse width, maximum power, and frequency.
+ *          Replace the per buffer min/max volume estimate with a streaming fixed point DC blocker, envelope follower, and AGC.
+ *          Analyze each source once per buffer, shared by all channels using it. Add frequency band selection.
+ *          Add onset (beat) detection, launching action lists and pulsing trigger inputs.
  */
-#include "swx.h"
+#include "audio.h"
 #include <stdlib.h>
-
-#include "pulse_gen.h"
+#include <string.h>
 
 #include "analog_capture.h"
 #include "output.h"
+#include "trigger.h"
+#include "action.h"
+
+#include "util/pitch.h"
+#include "util/filter.h"
+#include "util/swar.h"
+
+// Filter state fixed point formats. Samples are 16 bit (see analog_view_sample()), so are 10-bit counts in SIGNAL_Q.
+#define DC_Q (16)         // DC blocker state
+#define SIGNAL_Q (6)      // samples, DC blocked signal and envelope, max amplitude 512 counts fits in 16 bits
+#define DC_SHIFT_MAX (15) // max DC blocker pole shift (~0.2 Hz at 44.1 kHz), see REG_SRCn_DC_SHIFT
+static_assert(SIGNAL_Q == THRESHOLD_Q); // Block levels are passed to thresholds without rescaling
+
+#define GAIN_UNITY (256)                                    // Q8
+#define FULL_SCALE_BITS (7)                                 // envelope amplitude of 128 counts is full power
+#define INTENSITY_SHIFT (16 - (FULL_SCALE_BITS + SIGNAL_Q)) // envelope (Q6) -> Q16 intensity
+
+#define AUDIO_BLOCK_SIZE (16)                                       // samples per envelope block
+#define AUDIO_MAX_BLOCKS (ANALOG_VIEW_MAX_COUNT / AUDIO_BLOCK_SIZE) // max envelope blocks per buffer
+#define AUDIO_MAX_CROSSINGS (128)                                   // max zero crossings per buffer
+#define AUDIO_CROSSING_MIN_US (100)                                 // crossings closer than this to the previous are ignored (10 kHz)
+#define AUDIO_POWER_QUEUE (128)                                     // scheduled block intensities per channel, must be a power of 2
+#define AUDIO_POWER_QUEUE_MASK (AUDIO_POWER_QUEUE - 1)
+#define AUDIO_POWER_MAX_AHEAD_US (1000000)                          // scheduled intensities further ahead than this are stale
+
+#define AUDIO_SOURCE_COUNT (TOTAL_ANALOG_CHANNELS)
+static_assert(AUDIO_SOURCE_COUNT <= MAX_AUDIO_SRCS); // Ensure every source has register entries
+
+// Pitch detection range
+#ifndef AUDIO_PITCH_MIN_DHZ
+#define AUDIO_PITCH_MIN_DHZ (500) // 50 Hz
+#endif
+#ifndef AUDIO_PITCH_MAX_DHZ
+#define AUDIO_PITCH_MAX_DHZ (10000) // 1 kHz
+#endif
+
+// Onset detection energy time constants, short term and long term average
+#ifndef AUDIO_ONSET_FAST_MS
+#define AUDIO_ONSET_FAST_MS (10)
+#endif
+#ifndef AUDIO_ONSET_SLOW_MS
+#define AUDIO_ONSET_SLOW_MS (1000)
+#endif
+
+// Audio pulses are scheduled this far after the sample that caused them, unless in low latency mode
+#ifndef AUDIO_LOOKAHEAD_US
+#define AUDIO_LOOKAHEAD_US (20000)
+#endif
+
+// Low latency lookahead margins, on top of the measured delay from a buffer's first sample being taken until it is processed
+#define AUDIO_LOOKAHEAD_MARGIN_US (300) // jitter of the main loop
+#define AUDIO_QUEUE_MARGIN_US (50)      // per pulse already queued, since pulses are output in order
+
+#define PITCH_SAMPLE_PERIOD_Q8 (181 << 8) // samples are decimated to ~5.5 kHz for pitch detection
+
+// Min time between pitch estimates. The history is still updated every buffer, this only limits the lag search, which would
+// otherwise run for every ~1 ms buffer in low latency mode.
+#ifndef AUDIO_PITCH_INTERVAL_US
+#define AUDIO_PITCH_INTERVAL_US (5000)
+#endif
+
+// Filter bank band center frequencies, selected per channel with REG_CHn_AUDIO_BAND
+#ifndef AUDIO_BAND_CENTERS_HZ
+#define AUDIO_BAND_CENTERS_HZ {100, 400, 1500, 5000} // bass, low mid, high mid, treble
+#endif
+#define AUDIO_BAND_DAMPING_Q14 (11469) // 0.7, about one octave wide
+
+static const uint16_t band_centers_hz[AUDIO_BANDS] = AUDIO_BAND_CENTERS_HZ;
+
+typedef struct {
+   uint32_t time_us; // time the crossing sample was taken
+   uint16_t block;   // envelope block the crossing is in
+} audio_crossing_t;
+
+// Block peaks and zero crossings of a source frequency band (or the broadband signal)
+typedef struct {
+   uint32_t seq;                      // capture buffer sequence number analyzed, zero if none
+
+   svf_state_t filter;                // band pass filter state (unused for broadband)
+   int32_t last;                      // previous sample (Q6)
+   int8_t polarity;                   // zero crossing detector state, sign of signal once past hysteresis (zero if unknown)
+   uint32_t zero_time_us;             // interpolated time of the most recent sign change
+   uint32_t peak;                     // peak amplitude of the current block (Q6)
+
+   uint16_t blocks[AUDIO_MAX_BLOCKS]; // peak amplitude per block (Q6)
+
+   uint16_t crossing_count;
+   audio_crossing_t crossings[AUDIO_MAX_CROSSINGS];
+} audio_band_t;
+
+// Analysis of an audio source, computed once per capture buffer and shared by all channels using the source
+typedef struct {
+   uint32_t seq;                      // capture buffer sequence number analyzed, zero if none
+
+   bool primed;                       // filter state has been seeded with a sample
+   int32_t dc_x;                      // previous input sample (Q16)
+   int32_t dc_y;                      // DC blocker output (Q16)
+   uint32_t last_time_us;             // time of previous sample
+   uint32_t start_time_us;            // time the first sample of the analyzed buffer was taken
+
+   uint32_t block_period_q8;          // duration of an envelope block in microseconds (Q8)
+   uint16_t block_count;
+
+   audio_band_t bands[AUDIO_BANDS + 1]; // index 0 is broadband, only bands selected by a channel are analyzed
+
+   // Pitch tracking, only run while a channel using the source is in pitch mode
+   int16_t pitch_history[PITCH_HISTORY]; // decimated DC blocked samples (counts), ring buffer
+   uint16_t pitch_pos;                   // next history write index
+   int32_t pitch_acc;                    // decimation accumulator (Q6)
+   uint8_t pitch_acc_count;
+   uint16_t pitch_dhz;                   // detected pitch, zero if not periodic
+   uint32_t pitch_time_us;               // time of the last sample of the most recent estimate
+
+   // Onset detection, only run while enabled (see REG_SRCn_ONSET_SENSITIVITY)
+   uint32_t onset_fast;     // short term mean rectified level (Q6)
+   uint32_t onset_slow;     // long term mean rectified level (Q6)
+   bool onset_armed;        // short term level has fallen below the threshold since the last onset
+   uint32_t onset_time_us;  // time of the last onset
+   uint16_t onset_count;
+} audio_source_t;
+
+// Intensity of an envelope block, applied at the block end time plus the lookahead (same as pulses)
+typedef struct {
+   uint32_t time_us;
+   uint32_t intensity; // Q16
+} audio_power_t;
+
+typedef struct {
+   uint32_t seq;  // last source buffer processed
+   uint32_t env;  // envelope level (Q6)
+   uint32_t gain; // AGC gain (Q8)
+   bool active;   // envelope is above the gate
+
+   audio_power_t power_queue[AUDIO_POWER_QUEUE]; // scheduled block intensities, oldest first
+   uint8_t power_head;                           // next write index
+   uint8_t power_tail;                           // next read index
+   uint32_t intensity;                           // intensity of the latest due block (Q16)
+
+   uint32_t lookahead_us; // time from a sample being taken to its pulse
+   uint32_t delay_us;     // peak time from a buffer's first sample being taken until processed (decays)
+} audio_state_t;
+
+static const audio_source_t* analyze_source(analog_channel_t audio_src);
+static inline void process_channel(channel_data_t* ch, uint8_t ch_index, const audio_source_t* src, const audio_band_t* band, audio_mode_t mode);
+
+static audio_source_t sources[AUDIO_SOURCE_COUNT];
+static audio_state_t states[CHANNEL_COUNT];
+
+static uint8_t onset_mask; // sources with onsets since last taken (bit per source, see ANALOG_SRC_MASK)
+
+void audio_init() {
+   LOG_DEBUG("Init audio...\n");
+
+   for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
+      const uint16_t offset = ch_index * AUDIO_SIZE;
 
-static inline void process_samples(channel_data_t* ch, uint8_t ch_index, analog_channel_t audio_src, uint16_t sample_count, uint16_t* buffer, float* out_intensity,
-                                   uint32_t capture_end_time_us);
-static void process_sample(channel_data_t* ch, uint8_t ch_index, uint32_t time_us, int32_t value);
+      set_state16(REG_CHn_AUDIO_ATTACK_w + offset, 5);                    // 5 ms
+      set_state16(REG_CHn_AUDIO_RELEASE_w + offset, 150);                 // 150 ms
+      set_state16(REG_CHn_AUDIO_GATE_w + offset, 7);                      // 7 counts
+      set_state16(REG_CHn_AUDIO_AGC_TARGET_w + offset, 0);                // disabled
+      set_state16(REG_CHn_AUDIO_AGC_MAX_GAIN_w + offset, 8 * GAIN_UNITY); // 8x
+      set_state16(REG_CHn_AUDIO_AGC_TIME_w + offset, 2000);               // 2 seconds
 
-static int32_t last_sample_values[CHANNEL_COUNT] = {0};
-static uint32_t last_process_times_us[CHANNEL_COUNT] = {0};
+      states[ch_index].seq = 0;
+      states[ch_index].env = 0;
+      states[ch_index].gain = GAIN_UNITY;
+      states[ch_index].lookahead_us = AUDIO_LOOKAHEAD_US;
+      states[ch_index].delay_us = 0;
+      states[ch_index].power_head = 0;
+      states[ch_index].power_tail = 0;
+      states[ch_index].intensity = 0;
+   }
+
+   for (uint8_t i = 0; i < AUDIO_SOURCE_COUNT; i++) {
+      set_state(REG_SRCn_DC_SHIFT + i * AUDIO_SRC_SIZE, 8);   // ~27 Hz at 44.1 kHz
+      set_state(REG_SRCn_HYSTERESIS + i * AUDIO_SRC_SIZE, 4); // 4 counts
+
+      set_state(REG_SRCn_ONSET_SENSITIVITY + i * AUDIO_SRC_SIZE, 0);      // disabled
+      set_state16(REG_SRCn_ONSET_REFRACTORY_w + i * AUDIO_SRC_SIZE, 150); // 150 ms (max 400 BPM)
+      set_state16(REG_SRCn_ONSET_ACTION_w + i * AUDIO_SRC_SIZE, 0);       // no actions
+
+      sources[i].seq = 0;
+      sources[i].primed = false;
+      sources[i].onset_fast = 0;
+      sources[i].onset_slow = 0;
+      sources[i].onset_armed = false;
+      sources[i].onset_time_us = 0;
+      sources[i].onset_count = 0;
+   }
+
+   onset_mask = 0;
+}
+
+void audio_process_sources() {
+   // Sources used by channels are analyzed by audio_process(), this covers sources only used for onsets or thresholds
+   const uint8_t threshold_sources = triggers_threshold_sources();
+   for (analog_channel_t audio_src = AUDIO_CHANNEL_MIC; audio_src < AUDIO_CHANNEL_MIC + AUDIO_SOURCE_COUNT; audio_src++) {
+      if (get_state(REG_SRCn_ONSET_SENSITIVITY + (audio_src - AUDIO_CHANNEL_MIC) * AUDIO_SRC_SIZE) || (threshold_sources & ANALOG_SRC_MASK(audio_src)))
+         analyze_source(audio_src);
+   }
+}
+
+uint8_t audio_take_onsets() {
+   const uint8_t mask = onset_mask;
+   onset_mask = 0;
+   return mask;
+}
 
 /*
  * Process audio in a similar way to the Audio3 mode of a mk312b box.
  *
  * - Every zero crossing, trigger a pulse, but limit pulse frequency to the maximum parameter or 500 Hz, whatever is lower.
+ *   Crossings need the signal to pass a hysteresis level to reject noise, and are timed by interpolating between samples.
+ *
+ * - Adjust output power based on volume. Samples are streamed through a DC blocking filter and an attack/release envelope
+ *   follower (optionally with AGC), all in fixed point. The intensity of every envelope block (AUDIO_BLOCK_SIZE samples) is
+ *   scheduled with the same lookahead as the pulses, so power tracks the envelope within a buffer, not once per buffer.
+ *   Power updates are still limited by the DAC write time (~110us/ch), which is about one update per block at 44.1 kHz.
+ *
+ * - In pitch mode, pulse at the detected pitch of the source instead, mapped into the frequency parameter min-max.
+ *
+ * - Each source is analyzed once per buffer (DC blocking, block peaks, zero crossings), channels sharing a source only run
+ *   their own envelope over the block peaks and pick pulses from the crossing list. So cost stays flat as channels are added.
+ *
+ * - Channels can select a frequency band (e.g. bass) instead of the broadband signal. Bands are filtered once per source buffer
+ *   by a filter bank, and only while selected by a channel.
+ *
+ * - Onsets (beats) are detected per source from the broadband level, comparing a short term average against a long term average.
+ *   Each onset runs the source action list and pulses trigger inputs using the source (see REG_TRIGn_SOURCE_w).
+ *   Analog threshold trigger inputs are also fed from here, with the mean level and envelope of each block.
  *
- * - Adjust output power based on volume. Using the difference between min and max of the sample capture values.
+ * - Audio is captured via DMA in blocks of samples (341 per source by default, see REG_CAPTURE_LENGTH_w), making the samples up to ~8ms old.
+ *   Samples are read from the interleaved DMA buffer (see analog_view_t) a block at a time, two samples per word (see util/swar.h).
+ *   Every source is left justified to 16 bits, so ADC samples keep all 12 bits and I2S/PCM samples all 16 bits through the filters,
+ *   envelope and thresholds.
+ *   Samples uploaded by the I2C master (see REG_PCM_DATA) are played out against the device clock as if they were captured.
  *
- * - Audio is captured via DMA in blocks of about 341 (1/3 of 1024) samples per analog channel, making the samples at least ~16ms old.
+ * - Sample times are derived from the ADC conversion (or I2S frame) count, so we know exactly when each sample was taken. So we can use that
+ *   information to schedule pulses +20ms in the future. The downside is that this introduces ~20ms of latency.
  *
- * - We know fairly accurately when the capture finished, and how long it was. So we can use that information to
- *   schedule pulses +16ms in the future. The downside is that this introduces ~16ms of latency.
+ * - In low latency mode (see REG_AUDIO_LOW_LATENCY), capture buffers are ~1 ms and the lookahead tracks the measured delay until
+ *   a buffer is processed plus a margin for queued pulses, which is typically a few milliseconds.
  */
 void audio_process(channel_data_t* ch, uint8_t ch_index, uint16_t power) {
-   uint16_t sample_count;
-   uint16_t* sample_buffer;
-   uint32_t capture_end_time_us = 0;
-
-   // Fetch audio from the specific analog channel
+   // Analyze audio from the specific analog channel, if not already done for the latest buffer
    const analog_channel_t audio_src = get_state(REG_CHn_AUDIO_SRC + ch_index);
-   fetch_analog_buffer(audio_src, &sample_count, &sample_buffer, &capture_end_time_us);
+   const audio_source_t* src = analyze_source(audio_src);
 
-   // Skip processing if audio samples are older than previously processed
-   if (capture_end_time_us <= last_process_times_us[ch_index])
+   if (!src)
       return;
-   last_process_times_us[ch_index] = capture_end_time_us;
 
-   // Process audio samples by converting them into pulses and calculating intensity to scale power level
-   float intensity;
-   process_samples(ch, ch_index, audio_src, sample_count, sample_buffer, &intensity, capture_end_time_us);
+   const audio_mode_t mode = get_state(REG_CHn_AUDIO_MODE + ch_index);
+   audio_state_t* st = &states[ch_index];
+
+   // Use the selected frequency band, if it has been analyzed for the latest buffer
+   uint8_t band_index = get_state(REG_CHn_AUDIO_BAND + ch_index);
+   if (band_index > AUDIO_BANDS)
+      band_index = 0;
+   const audio_band_t* band = &src->bands[band_index];
+
+   // Skip processing if the source buffer was already processed by this channel
+   if (src->seq != st->seq && band->seq == src->seq) {
+      st->seq = src->seq;
+
+      // Convert analysis into pulses, and schedule the intensity of each block to scale the power level
+      process_channel(ch, ch_index, src, band, mode);
+   }
+
+   // Take the intensity of the latest block that is due
+   const uint32_t time = time_us_32();
+   while (st->power_tail != st->power_head) {
+      const audio_power_t* p = &st->power_queue[st->power_tail];
+      const uint32_t ahead_us = p->time_us - time;
+      if (ahead_us != 0 && ahead_us <= AUDIO_POWER_MAX_AHEAD_US)
+         break; // not due yet
+      st->intensity = p->intensity;
+      st->power_tail = (st->power_tail + 1) & AUDIO_POWER_QUEUE_MASK;
+   }
 
    // Set channel output power, limit updates to ~2.2 kHz since it takes the DAC about ~110us/ch
-   uint32_t time = time_us_32();
    if (time - ch->last_power_time_us > 110 * CHANNEL_COUNT) {
       ch->last_power_time_us = time;
 
       const uint16_t power_max = GET_VALUE(ch_index, PARAM_POWER, TARGET_MAX);
 
       // scale power level with audio intensity, ensure power is between min-max
-      power *= intensity;
+      power = (power * st->intensity) >> 16;
       if (power > power_max)
          power = power_max;
 
       output_set_power(ch_index, power);
    }
+
+   // Pitch mode pulses at the tracked frequency, while the level is above the gate
+   if (mode == AUDIO_MODE_PITCH && st->active)
+      pulse_gen_pulse(ch, ch_index);
 }
 
-static inline void process_samples(channel_data_t* ch, uint8_t ch_index, analog_channel_t audio_src, uint16_t sample_count, uint16_t* buffer, float* out_intensity,
-                                   uint32_t capture_end_time_us) {
-   // Find the min, max, and mean sample values
-   uint32_t min = UINT32_MAX;
-   uint32_t max = 0;
-   uint32_t total = 0;
-   for (uint16_t x = 0; x < sample_count; x++) {
-      if (buffer[x] > max)
-         max = buffer[x];
+// Returns the Q16 filter coefficient for a first order smoother with the given time constant, updated every period (Q8 microseconds)
+static inline uint32_t smoothing_coeff(uint32_t period_q8, uint16_t time_constant_ms) {
+   if (time_constant_ms == 0)
+      return 1 << 16; // instant
 
-      if (buffer[x] < min)
-         min = buffer[x];
+   const uint32_t coeff = ((uint64_t)period_q8 << 8) / (time_constant_ms * 1000ul);
+   if (coeff < 1)
+      return 1;
+   if (coeff > (1 << 16))
+      return 1 << 16;
+   return coeff;
+}
 
-      total += buffer[x];
+// Size the lookahead used for the next buffer. In low latency mode, use the peak delay from the first sample of a buffer being
+// taken until it has been processed, so pulses are scheduled in time without waiting longer than needed.
+static inline void update_lookahead(audio_state_t* st, const audio_source_t* src) {
+   if (!get_state(REG_AUDIO_LOW_LATENCY)) {
+      st->lookahead_us = AUDIO_LOOKAHEAD_US;
+      return;
    }
 
-   const uint16_t avg = total / sample_count;
+   const uint32_t delay_us = time_us_32() - src->start_time_us;
+   if (delay_us > st->delay_us)
+      st->delay_us = delay_us; // rise instantly, a late pulse is worse than a little extra latency
+   else
+      st->delay_us -= (st->delay_us - delay_us) >> 6;
 
-   // Noise filter
-   if (abs((int32_t)min - avg) < 7 && abs((int32_t)max - avg) < 7) {
-      *out_intensity = 0;
-      return;
+   st->lookahead_us = st->delay_us + AUDIO_LOOKAHEAD_MARGIN_US + output_pulse_queue_level() * AUDIO_QUEUE_MARGIN_US;
+}
+
+// Estimate the pitch of the source decimated sample history, sampled every period (Q8 microseconds). Returns pitch in dHz, 0 if not periodic.
+static uint16_t track_pitch(const audio_source_t* src, uint32_t period_q8) {
+   static int16_t history[PITCH_HISTORY];
+
+   // Unroll ring buffer, oldest first
+   const uint16_t split = PITCH_HISTORY - src->pitch_pos;
+   memcpy(history, &src->pitch_history[src->pitch_pos], split * sizeof(int16_t));
+   memcpy(&history[split], src->pitch_history, src->pitch_pos * sizeof(int16_t));
+
+   // Search lags covering the pitch detection range. Period in Q8 us is 10^7 * 256 / dHz
+   const uint16_t min_lag = (10000000ul * 256 / AUDIO_PITCH_MAX_DHZ) / period_q8;
+   const uint16_t max_lag = (10000000ul * 256 / AUDIO_PITCH_MIN_DHZ) / period_q8 + 1;
+
+   const uint32_t lag_q8 = pitch_estimate(history, min_lag, max_lag);
+   if (lag_q8 == 0)
+      return 0;
+
+   // dHz = 10^7 / (period_us * lag)
+   return (10000000ull << 16) / ((uint64_t)period_q8 * lag_q8);
+}
+
+// Add a sample to the band, tracking the block peak and zero crossings
+static inline void band_sample(audio_band_t* band, int32_t value, uint32_t time_us, uint32_t last_time_us, int32_t hysteresis, uint16_t block) {
+   const uint32_t rect = abs(value);
+   if (rect > band->peak)
+      band->peak = rect;
+
+   // Remember when the signal changed sign, linearly interpolated between the two samples
+   const int32_t last = band->last;
+   if ((value > 0 && last <= 0) || (value < 0 && last >= 0)) {
+      const uint32_t a = abs(last);
+      const uint32_t frac_q8 = (a << 8) / (a + rect); // a + rect is non-zero, since value is non-zero
+      band->zero_time_us = last_time_us + (((time_us - last_time_us) * frac_q8) >> 8);
+   }
+
+   // Zero crossing once the signal passes the hysteresis level on the other side, timed at the sign change
+   if ((value > hysteresis && band->polarity <= 0) || (value < -hysteresis && band->polarity >= 0)) {
+      const bool crossing = band->polarity != 0;
+      band->polarity = value > 0 ? 1 : -1;
+
+      const uint16_t count = band->crossing_count;
+      if (crossing && count < AUDIO_MAX_CROSSINGS && (count == 0 || band->zero_time_us - band->crossings[count - 1].time_us >= AUDIO_CROSSING_MIN_US)) {
+         band->crossings[count].time_us = band->zero_time_us;
+         band->crossings[count].block = block;
+         band->crossing_count = count + 1;
+      }
+   }
+
+   band->last = value;
+}
+
+// Fetch the latest buffer of the source, and stream it through the DC blocker and selected band filters, collecting block peaks
+// and zero crossings. Returns NULL if the source is invalid.
+static const audio_source_t* analyze_source(analog_channel_t audio_src) {
+   if (audio_src < AUDIO_CHANNEL_MIC || audio_src >= AUDIO_CHANNEL_MIC + AUDIO_SOURCE_COUNT)
+      return NULL;
+
+   audio_source_t* src = &sources[audio_src - AUDIO_CHANNEL_MIC];
+
+   analog_view_t view;
+   uint32_t capture_end_time_us;
+   if (!fetch_analog_buffer(audio_src, &view, &capture_end_time_us) || view.count == 0)
+      return src; // no new samples, previous analysis still valid
+
+   const uint8_t src_index = audio_src - AUDIO_CHANNEL_MIC;
+   const uint16_t offset = src_index * AUDIO_SRC_SIZE;
+   const uint8_t dc_shift = MIN(get_state(REG_SRCn_DC_SHIFT + offset), DC_SHIFT_MAX); // larger shifts overflow the pole
+   const int32_t hysteresis = get_state(REG_SRCn_HYSTERESIS + offset) << SIGNAL_Q;
+   const uint8_t sensitivity = get_state(REG_SRCn_ONSET_SENSITIVITY + offset);
+   const bool thresholds = triggers_threshold_sources() & ANALOG_SRC_MASK(audio_src);
+
+   // Only analyze the bands and pitch needed by channels using this source
+   bool pitch = false;
+   uint8_t band_mask = 0;
+   for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
+      if (get_state(REG_CHn_AUDIO_SRC + ch_index) != audio_src)
+         continue;
+
+      pitch |= get_state(REG_CHn_AUDIO_MODE + ch_index) == AUDIO_MODE_PITCH;
+
+      const uint8_t band_index = get_state(REG_CHn_AUDIO_BAND + ch_index);
+      band_mask |= 1 << (band_index > AUDIO_BANDS ? 0 : band_index);
+   }
+
+   svf_coeffs_t coeffs[AUDIO_BANDS + 1];
+   for (uint8_t b = 0; b <= AUDIO_BANDS; b++) {
+      if (!(band_mask & (1 << b)))
+         continue;
+      if (b > 0)
+         svf_design(&coeffs[b], band_centers_hz[b - 1], view.sample_period_q8, AUDIO_BAND_DAMPING_Q14);
+      src->bands[b].crossing_count = 0;
+      src->bands[b].peak = 0;
+   }
+
+   // Decimate to roughly the pitch sample rate, averaging to filter out higher frequencies
+   uint8_t decimation = (PITCH_SAMPLE_PERIOD_Q8 + view.sample_period_q8 / 2) / view.sample_period_q8;
+   if (decimation < 1)
+      decimation = 1;
+   const int32_t decimation_recip_q12 = 4096 / decimation;
+
+   // Onset when the short term level exceeds the long term level by the threshold ratio (Q5), and is above the hysteresis level
+   const bool onset = sensitivity != 0;
+   const uint32_t onset_threshold_q5 = 32 + (256 - sensitivity);
+   const uint32_t onset_refractory_us = get_state16(REG_SRCn_ONSET_REFRACTORY_w + offset) * 1000ul;
+   const uint32_t block_period_q8 = view.sample_period_q8 * AUDIO_BLOCK_SIZE;
+   const uint32_t onset_fast_coeff = smoothing_coeff(block_period_q8, AUDIO_ONSET_FAST_MS);
+   const uint32_t onset_slow_coeff = smoothing_coeff(block_period_q8, AUDIO_ONSET_SLOW_MS);
+   uint8_t onsets = 0;
+
+   if (!src->primed) {
+      src->primed = true;
+      src->dc_x = analog_view_sample(&view, 0) << (DC_Q - SIGNAL_Q);
+      src->dc_y = 0;
+      src->last_time_us = view.start_time_us;
+   }
+
+   int32_t dc_x = src->dc_x;
+   int32_t dc_y = src->dc_y;
+   uint32_t last_time_us = src->last_time_us;
+   int32_t pitch_acc = src->pitch_acc;
+   uint8_t pitch_acc_count = src->pitch_acc_count;
+
+   uint16_t samples[AUDIO_BLOCK_SIZE] __attribute__((aligned(4)));
+
+   uint16_t block = 0;
+   for (uint16_t start = 0; start < view.count; start += AUDIO_BLOCK_SIZE, block++) {
+      const uint16_t end = MIN(start + AUDIO_BLOCK_SIZE, view.count);
+      uint32_t level = 0;
+      uint32_t envelope = 0;
+
+      analog_view_read(&view, start, end - start, samples);
+
+      for (uint16_t i = start; i < end; i++) {
+         const int32_t x = samples[i - start] << (DC_Q - SIGNAL_Q);
+
+         // DC blocker: y[n] = x[n] - x[n-1] + (1 - 2^-k) * y[n-1]
+         int32_t value;
+         if (dc_shift) {
+            dc_y += x - dc_x - (dc_y >> dc_shift);
+            dc_x = x;
+            value = dc_y >> (DC_Q - SIGNAL_Q);
+         } else {
+            value = (x - (0x8000 << (DC_Q - SIGNAL_Q))) >> (DC_Q - SIGNAL_Q); // assume DC offset is mid-scale (~1.65V)
+         }
+
+         const uint32_t time_us = analog_view_sample_time_us(&view, i);
+
+         if (band_mask & 1)
+            band_sample(&src->bands[0], value, time_us, last_time_us, hysteresis, block);
+
+         for (uint8_t b = 1; b <= AUDIO_BANDS; b++) {
+            if (band_mask & (1 << b))
+               band_sample(&src->bands[b], svf_bandpass(&src->bands[b].filter, &coeffs[b], value), time_us, last_time_us, hysteresis, block);
+         }
+
+         last_time_us = time_us;
+
+         if (onset)
+            level += abs(value);
+         if (thresholds && (uint32_t)abs(value) > envelope)
+            envelope = abs(value);
+
+         if (pitch) {
+            pitch_acc += value;
+            if (++pitch_acc_count >= decimation) {
+               src->pitch_history[src->pitch_pos] = ((pitch_acc >> SIGNAL_Q) * decimation_recip_q12) >> 12;
+               if (++src->pitch_pos >= PITCH_HISTORY)
+                  src->pitch_pos = 0;
+
+               pitch_acc = 0;
+               pitch_acc_count = 0;
+            }
+         }
+      }
+
+      if (thresholds) {
+         uint16_t min, max;
+         const uint16_t mean = swar_minmax_sum(samples, end - start, &min, &max) / (end - start);
+         triggers_threshold_block(audio_src, mean, envelope);
+      }
+
+      for (uint8_t b = 0; b <= AUDIO_BANDS; b++) {
+         if (band_mask & (1 << b)) {
+            src->bands[b].blocks[block] = src->bands[b].peak;
+            src->bands[b].peak = 0;
+         }
+      }
+
+      if (onset) {
+         level /= end - start;
+
+         uint32_t fast = src->onset_fast;
+         uint32_t slow = src->onset_slow;
+         fast = level > fast ? fast + (((level - fast) * onset_fast_coeff) >> 16) : fast - (((fast - level) * onset_fast_coeff) >> 16);
+         slow = level > slow ? slow + (((level - slow) * onset_slow_coeff) >> 16) : slow - (((slow - level) * onset_slow_coeff) >> 16);
+         src->onset_fast = fast;
+         src->onset_slow = slow;
+
+         if ((fast << 5) <= slow * onset_threshold_q5) {
+            src->onset_armed = true;
+         } else if (src->onset_armed && fast > (uint32_t)hysteresis && last_time_us - src->onset_time_us >= onset_refractory_us) {
+            src->onset_armed = false;
+            src->onset_time_us = last_time_us;
+            onsets++;
+         }
+      }
+   }
+
+   src->dc_x = dc_x;
+   src->dc_y = dc_y;
+   src->last_time_us = last_time_us;
+   src->pitch_acc = pitch_acc;
+   src->pitch_acc_count = pitch_acc_count;
+
+   if (pitch && last_time_us - src->pitch_time_us >= AUDIO_PITCH_INTERVAL_US) {
+      src->pitch_time_us = last_time_us;
+      src->pitch_dhz = track_pitch(src, view.sample_period_q8 * decimation);
+      set_state16(REG_SRCn_PITCH_w + src_index * AUDIO_SRC_STATUS_SIZE, src->pitch_dhz);
    }
 
-   *out_intensity = (max - min) / 255.0f;                                            // crude approximation of volume
+   src->block_count = block;
+   src->block_period_q8 = block_period_q8;
+   src->start_time_us = view.start_time_us;
+   src->seq = view.seq;
 
-   const uint32_t capture_duration_us = get_capture_duration_us(audio_src);          // buffer capture duration
-   const uint32_t capture_start_time_us = capture_end_time_us - capture_duration_us; // time when capture started
+   if (onsets) {
+      src->onset_count += onsets;
+      set_state16(REG_SRCn_ONSET_COUNT_w + src_index * AUDIO_SRC_STATUS_SIZE, src->onset_count);
 
-   const uint32_t sample_duration_us = capture_duration_us / sample_count;           // single sample duration
+      onset_mask |= ANALOG_SRC_MASK(audio_src);
+      triggers_notify();
 
-   // Call process each sample at roughly the time it happened, with a signed value ranging from -128 to +128 (assuming DC offset is ~1.65V)
-   for (uint16_t i = 0; i < sample_count; i++) {
-      const uint32_t sample_time_us = capture_start_time_us + (sample_duration_us * i);
-      const int32_t value = avg - buffer[i];
+      // Run the onset action list, at most once per buffer
+      const uint16_t action = get_state16(REG_SRCn_ONSET_ACTION_w + offset);
+      if (action)
+         execute_action_list(action >> 8, action & 0xff); // start:upper byte, end: lower byte
+   }
 
-      process_sample(ch, ch_index, sample_time_us, value);
+   for (uint8_t b = 0; b <= AUDIO_BANDS; b++) {
+      if (band_mask & (1 << b))
+         src->bands[b].seq = view.seq;
    }
+   return src;
+}
+
+// Returns the intensity (Q16) of an envelope level, zero below the noise gate
+static inline uint32_t block_intensity(uint32_t env, uint32_t gain, uint32_t gate) {
+   if (env < gate)
+      return 0;
+   const uint32_t intensity = ((env * gain) >> 8) << INTENSITY_SHIFT;
+   return intensity > (1 << 16) ? (1 << 16) : intensity;
 }
 
-static inline void process_sample(channel_data_t* ch, uint8_t ch_index, uint32_t time_us, int32_t value) {
-   // Check for zero crossing
-   if (((value > 0 && last_sample_values[ch_index] <= 0) || (value < 0 && last_sample_values[ch_index] >= 0))) {
+// Queue the intensity of a block, dropping the oldest if the queue is full
+static inline void schedule_intensity(audio_state_t* st, uint32_t time_us, uint32_t intensity) {
+   const uint8_t next = (st->power_head + 1) & AUDIO_POWER_QUEUE_MASK;
+   if (next == st->power_tail)
+      st->power_tail = (st->power_tail + 1) & AUDIO_POWER_QUEUE_MASK;
+
+   st->power_queue[st->power_head] = (audio_power_t){.time_us = time_us, .intensity = intensity};
+   st->power_head = next;
+}
+
+// Run the channel envelope over the band block peaks, triggering a pulse on zero crossings or tracking pitch depending on mode.
+// The intensity at the end of each block is scheduled to scale the power level.
+static inline void process_channel(channel_data_t* ch, uint8_t ch_index, const audio_source_t* src, const audio_band_t* band, audio_mode_t mode) {
+   audio_state_t* st = &states[ch_index];
+
+   const uint16_t offset = ch_index * AUDIO_SIZE;
+   const uint32_t attack = smoothing_coeff(src->block_period_q8, get_state16(REG_CHn_AUDIO_ATTACK_w + offset));
+   const uint32_t release = smoothing_coeff(src->block_period_q8, get_state16(REG_CHn_AUDIO_RELEASE_w + offset));
+   const uint32_t gate = get_state16(REG_CHn_AUDIO_GATE_w + offset) << SIGNAL_Q;
 
-      uint32_t min_period = 10000000ul / GET_VALUE(ch_index, PARAM_FREQUENCY, TARGET_MAX); // dHz -> us
-      if (min_period < 2000)                                                               // clamp to 500 Hz
-         min_period = 2000;
+   // limit pulses to parameter frequency maximum or 500 Hz, whatever is lower
+   uint32_t min_period = 10000000ul / GET_VALUE(ch_index, PARAM_FREQUENCY, TARGET_MAX); // dHz -> us
+   if (min_period < 2000)                                                               // clamp to 500 Hz
+      min_period = 2000;
 
-      if (time_us - ch->last_pulse_time_us >= min_period) { // limit pulses to parameter frequency maximum or 500 Hz, whatever is lower
-         ch->last_pulse_time_us = time_us;
+   const uint16_t pulse_width = GET_VALUE(ch_index, PARAM_PULSE_WIDTH, TARGET_VALUE);
 
-         const uint16_t pulse_width = GET_VALUE(ch_index, PARAM_PULSE_WIDTH, TARGET_VALUE);
+   uint32_t env = st->env;
+   uint16_t c = 0;
+   for (uint16_t block = 0; block < src->block_count; block++) {
+      // Envelope follower, rise with attack and fall with release time constant
+      const uint32_t peak = band->blocks[block];
+      if (peak > env)
+         env += ((peak - env) * attack) >> 16;
+      else
+         env -= ((env - peak) * release) >> 16;
 
-         output_pulse(ch_index, pulse_width, pulse_width, time_us + 20000); // 20 ms in future
+      // Pulse on zero crossings within the block, ignoring noise below gate level
+      for (; mode == AUDIO_MODE_CROSSING && c < band->crossing_count && band->crossings[c].block == block; c++) {
+         const uint32_t time_us = band->crossings[c].time_us;
+         if (env >= gate && time_us - ch->last_pulse_time_us >= min_period) {
+            ch->last_pulse_time_us = time_us;
+            output_pulse(ch_index, pulse_width, pulse_width, time_us + st->lookahead_us);
+         }
       }
+
+      const uint32_t block_end_us = src->start_time_us + (((block + 1) * src->block_period_q8) >> 8);
+      schedule_intensity(st, block_end_us + st->lookahead_us, block_intensity(env, st->gain, gate));
    }
+   st->env = env;
+
+   update_lookahead(st, src);
+   set_state16(REG_CHn_AUDIO_LATENCY_w + (ch_index * 2), st->lookahead_us > UINT16_MAX ? UINT16_MAX : st->lookahead_us);
+
+   // Automatic gain control, once per buffer. Nudge gain towards the target level, without amplifying noise below the gate.
+   const uint32_t agc_target = get_state16(REG_CHn_AUDIO_AGC_TARGET_w + offset) << SIGNAL_Q;
+   if (agc_target == 0) {
+      st->gain = GAIN_UNITY;
+   } else if (env >= gate) {
+      const uint32_t buffer_period_q8 = src->block_period_q8 * src->block_count;
+      const uint32_t agc = smoothing_coeff(buffer_period_q8, get_state16(REG_CHn_AUDIO_AGC_TIME_w + offset));
+      const uint32_t max_gain = get_state16(REG_CHn_AUDIO_AGC_MAX_GAIN_w + offset);
+
+      const uint32_t level = (env * st->gain) >> 8;
+      const uint32_t step = (st->gain * agc) >> 16;
+      if (level > agc_target)
+         st->gain -= MIN(step ? step : 1, st->gain - 1);
+      else if (level < agc_target)
+         st->gain += step ? step : 1;
 
-   last_sample_values[ch_index] = value;
-}
\ No newline at end of file
+      if (st->gain > max_gain)
+         st->gain = max_gain;
+   }
+
+   set_state16(REG_CHn_AUDIO_LEVEL_w + (ch_index * 2), env >> SIGNAL_Q);
+   set_state16(REG_CHn_AUDIO_GAIN_w + (ch_index * 2), st->gain);
+
+   st->active = env >= gate;
+   if (!st->active)
+      return; // Noise gate
+
+   // Map detected pitch into frequency parameter min/max, keeping the last frequency while not periodic
+   if (mode == AUDIO_MODE_PITCH && src->pitch_dhz) {
+      const uint16_t freq_min = GET_VALUE(ch_index, PARAM_FREQUENCY, TARGET_MIN);
+      const uint16_t freq_max = GET_VALUE(ch_index, PARAM_FREQUENCY, TARGET_MAX);
+
+      uint32_t pitch = src->pitch_dhz;
+      if (pitch < AUDIO_PITCH_MIN_DHZ)
+         pitch = AUDIO_PITCH_MIN_DHZ;
+      else if (pitch > AUDIO_PITCH_MAX_DHZ)
+         pitch = AUDIO_PITCH_MAX_DHZ;
+
+      const int32_t frequency = freq_min + ((int32_t)(pitch - AUDIO_PITCH_MIN_DHZ) * (freq_max - freq_min)) / (AUDIO_PITCH_MAX_DHZ - AUDIO_PITCH_MIN_DHZ);
+      SET_VALUE(ch_index, PARAM_FREQUENCY, TARGET_VALUE, frequency);
+   }
+}
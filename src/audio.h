@@ -0,0 +1,38 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _AUDIO_H
+#define _AUDIO_H
+
+#include "swx.h"
+
+#include "pulse_gen.h"
+
+// Set default audio processing parameters and reset filter state
+void audio_init();
+
+// Generate pulses and scale channel power using the channel audio source (see REG_CHn_AUDIO_SRC)
+void audio_process(channel_data_t* ch, uint8_t ch_index, uint16_t power);
+
+// Analyze sources used for onset detection (see REG_SRCn_ONSET_SENSITIVITY) or analog thresholds (see REG_THRESHn_SOURCE),
+// even if no channel uses them
+void audio_process_sources();
+
+// Returns sources with onsets since last called (bit per source, see ANALOG_SRC_MASK), and clears them
+uint8_t audio_take_onsets();
+
+#endif // _AUDIO_H
@@ -0,0 +1,279 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "benchmark.h"
+
+#ifdef SWX_BENCHMARK
+#include "analog_capture.h"
+#include "output.h"
+
+#include "util/bench.h"
+#include "util/curve.h"
+#include "util/pitch.h"
+#include "util/swar.h"
+
+#define BENCH_ITERATIONS (16)
+#define BENCH_SAMPLES (1024)
+#define BENCH_BUFFER_TIMEOUT_US (50000) // max wait for a new capture buffer, default buffers take ~7.7 ms
+
+static volatile uint32_t sink; // keeps results alive so loops aren't optimized away
+
+static const analog_channel_t capture_channels[] = {AUDIO_CHANNEL_MIC, AUDIO_CHANNEL_LEFT, AUDIO_CHANNEL_RIGHT};
+
+// Typical consumer pass over a buffer (min/max/sum, as done by audio processing)
+static uint32_t scan_buffer(const uint16_t* buffer, uint16_t count) {
+   uint16_t min = UINT16_MAX, max = 0;
+   uint32_t total = 0;
+   for (uint16_t x = 0; x < count; x++) {
+      const uint16_t sample = buffer[x];
+      if (sample > max)
+         max = sample;
+      if (sample < min)
+         min = sample;
+      total += sample;
+   }
+   return total + min + max;
+}
+
+static uint32_t scan_view(const analog_view_t* view) {
+   uint16_t min = UINT16_MAX, max = 0;
+   uint32_t total = 0;
+   for (uint16_t x = 0; x < view->count; x++) {
+      const uint16_t sample = analog_view_sample(view, x);
+      if (sample > max)
+         max = sample;
+      if (sample < min)
+         min = sample;
+      total += sample;
+   }
+   return total + min + max;
+}
+
+// Wait for a capture buffer of the channel that hasn't been fetched yet, returning the cycles taken by the fetch that returned it.
+// Returns false (with an empty view) if none completed within BENCH_BUFFER_TIMEOUT_US, e.g. the source isn't captured.
+static bool wait_for_buffer(analog_channel_t channel, analog_view_t* view, uint32_t* cycles) {
+   const uint32_t start_time_us = time_us_32();
+   uint32_t end_time_us;
+   do {
+      const uint32_t start = bench_start();
+      const bool available = fetch_analog_buffer(channel, view, &end_time_us);
+      *cycles = bench_cycles(start);
+      if (available && view->count)
+         return true;
+   } while (time_us_32() - start_time_us < BENCH_BUFFER_TIMEOUT_US);
+
+   view->count = 0;
+   return false;
+}
+
+// Cycles per source capture buffer, comparing the previous deinterleave copy with in place views and packed reads.
+// Each iteration waits for a new buffer, since capture has only just started and views are empty until the first buffer completes.
+static void bench_capture() {
+   static uint16_t scratch[BENCH_SAMPLES] __attribute__((aligned(4)));
+
+   uint32_t copy_cycles = 0;
+   uint32_t copy_scan_cycles = 0;
+   uint32_t fetch_cycles = 0;
+   uint32_t view_scan_cycles = 0;
+   uint32_t read_cycles = 0;
+   uint32_t read_scan_cycles = 0;
+   uint16_t buffers = 0;
+   uint16_t skipped = 0;
+
+   for (uint8_t i = 0; i < BENCH_ITERATIONS; i++) {
+      for (uint8_t c = 0; c < count_of(capture_channels); c++) {
+         analog_view_t view;
+         uint32_t cycles;
+         if (!wait_for_buffer(capture_channels[c], &view, &cycles)) {
+            skipped++;
+            continue;
+         }
+         fetch_cycles += cycles;
+         buffers++;
+
+         // Before: unravel interleaved capture buffer into a consumer buffer, shifting from 12 bit samples to 16 bit
+         uint32_t start = bench_start();
+         for (uint16_t x = 0; x < view.count; x++)
+            scratch[x] = (view.data[x * view.stride] & 0xFFF) << 4;
+         copy_cycles += bench_cycles(start);
+
+         start = bench_start();
+         sink = scan_buffer(scratch, view.count);
+         copy_scan_cycles += bench_cycles(start);
+
+         // After: consume directly from the DMA buffer
+         start = bench_start();
+         sink = scan_view(&view);
+         view_scan_cycles += bench_cycles(start);
+
+         // Packed: gather and convert two samples per word, then scan two per word
+         start = bench_start();
+         analog_view_read(&view, 0, view.count, scratch);
+         read_cycles += bench_cycles(start);
+
+         uint16_t min, max;
+         start = bench_start();
+         sink = swar_minmax_sum(scratch, view.count, &min, &max) + min + max;
+         read_scan_cycles += bench_cycles(start);
+      }
+   }
+
+   if (skipped)
+      LOG_WARN("bench: capture skipped %u empty buffers (source not captured or no buffer within %u us)\n", skipped, BENCH_BUFFER_TIMEOUT_US);
+   if (!buffers)
+      return;
+
+   LOG_INFO("bench: capture before: copy=%u scan=%u total=%u cycles/buffer\n", copy_cycles / buffers, copy_scan_cycles / buffers,
+            (copy_cycles + copy_scan_cycles) / buffers);
+   LOG_INFO("bench: capture after: fetch=%u scan=%u total=%u cycles/buffer\n", fetch_cycles / buffers, view_scan_cycles / buffers,
+            (fetch_cycles + view_scan_cycles) / buffers);
+   LOG_INFO("bench: capture packed: read=%u scan=%u total=%u cycles/buffer\n", read_cycles / buffers, read_scan_cycles / buffers,
+            (fetch_cycles + read_cycles + read_scan_cycles) / buffers);
+}
+
+// Log cycles per sample (2 decimal places) of a kernel, scalar vs packed
+static void log_kernel(const char* name, uint32_t scalar_cycles, uint32_t swar_cycles) {
+   const uint32_t scalar_q = scalar_cycles * 100 / BENCH_SAMPLES;
+   const uint32_t swar_q = swar_cycles * 100 / BENCH_SAMPLES;
+   LOG_INFO("bench: %s scalar=%u.%02u swar=%u.%02u cycles/sample\n", name, scalar_q / 100, scalar_q % 100, swar_q / 100, swar_q % 100);
+}
+
+// Cycles per sample of each SWAR kernel and its scalar version, over a buffer of synthetic samples
+static void bench_swar() {
+   static uint16_t src[BENCH_SAMPLES * 4] __attribute__((aligned(4)));
+   static uint16_t dst[BENCH_SAMPLES] __attribute__((aligned(4)));
+
+   uint32_t seed = 1;
+   for (uint16_t i = 0; i < count_of(src); i++) {
+      seed = seed * 1664525 + 1013904223;
+      src[i] = seed >> 16;
+   }
+
+   uint32_t start = bench_start();
+   swar_adc12_to_u16_scalar(dst, src, BENCH_SAMPLES);
+   uint32_t scalar_cycles = bench_cycles(start);
+   start = bench_start();
+   swar_adc12_to_u16(dst, src, BENCH_SAMPLES);
+   log_kernel("adc12_to_u16", scalar_cycles, bench_cycles(start));
+
+   start = bench_start();
+   swar_pcm16_to_u16_scalar(dst, src, BENCH_SAMPLES);
+   scalar_cycles = bench_cycles(start);
+   start = bench_start();
+   swar_pcm16_to_u16(dst, src, BENCH_SAMPLES);
+   log_kernel("pcm16_to_u16", scalar_cycles, bench_cycles(start));
+
+   // Interleaved pairs (2 ADC sources), mono from 32-bit I2S slots, and 3 ADC sources (odd strides aren't packed)
+   static const struct {
+      uint8_t stride;
+      const char* name;
+   } gathers[] = {{2, "gather_stride2"}, {3, "gather_stride3"}, {4, "gather_stride4"}};
+
+   for (uint8_t i = 0; i < count_of(gathers); i++) {
+      start = bench_start();
+      swar_gather_scalar(dst, src, BENCH_SAMPLES, gathers[i].stride);
+      scalar_cycles = bench_cycles(start);
+      start = bench_start();
+      swar_gather(dst, src, BENCH_SAMPLES, gathers[i].stride);
+      log_kernel(gathers[i].name, scalar_cycles, bench_cycles(start));
+   }
+
+   uint16_t min, max;
+   start = bench_start();
+   sink = swar_minmax_sum_scalar(src, BENCH_SAMPLES, &min, &max) + min + max;
+   scalar_cycles = bench_cycles(start);
+   start = bench_start();
+   sink = swar_minmax_sum(src, BENCH_SAMPLES, &min, &max) + min + max;
+   log_kernel("minmax_sum", scalar_cycles, bench_cycles(start));
+}
+
+// Cycles per pitch estimate, for a periodic signal (early exit) and noise (worst case, every lag searched).
+// Lags cover 50 Hz - 1 kHz at the ~5.5 kHz decimated rate used by audio pitch tracking.
+static void bench_pitch() {
+   static int16_t history[PITCH_HISTORY];
+   const uint16_t min_lag = 5;
+   const uint16_t max_lag = 111;
+
+   // 220 Hz triangle wave, ~25 samples per period
+   for (uint16_t i = 0; i < PITCH_HISTORY; i++) {
+      const int32_t phase = (i * 256 * 220 / 5512) & 0xFF;
+      history[i] = (phase < 128 ? phase : 255 - phase) * 2 - 128;
+   }
+
+   uint32_t start = bench_start();
+   const uint32_t lag_q8 = pitch_estimate(history, min_lag, max_lag);
+   const uint32_t periodic_cycles = bench_cycles(start);
+
+   // Pseudo random noise, no periodic lag
+   uint32_t seed = 1;
+   for (uint16_t i = 0; i < PITCH_HISTORY; i++) {
+      seed = seed * 1664525 + 1013904223;
+      history[i] = (int16_t)(seed >> 24) - 128;
+   }
+
+   start = bench_start();
+   sink = pitch_estimate(history, min_lag, max_lag);
+   const uint32_t noise_cycles = bench_cycles(start);
+
+   LOG_INFO("bench: pitch periodic=%u cycles (lag=%u.%02u) noise=%u cycles\n", periodic_cycles, lag_q8 >> 8, ((lag_q8 & 0xFF) * 100) >> 8, noise_cycles);
+}
+
+// Cycles per ramp power calculation, comparing the previous float divide and multiply with the curve lookup
+static void bench_ramp() {
+   const uint32_t ramp_time = 1000 * 1000;
+   volatile uint16_t power = CHANNEL_POWER_MAX;
+
+   uint32_t start = bench_start();
+   for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+      const uint32_t time_remaining = ramp_time - i * 977;
+      float power_modifier = (float)time_remaining / ramp_time;
+      sink = (uint16_t)((1.0f - power_modifier) * (float)power);
+   }
+   const uint32_t float_cycles = bench_cycles(start);
+
+   for (uint8_t curve = 0; curve < TOTAL_RAMP_CURVES; curve++) {
+      start = bench_start();
+      for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+         uint32_t elapsed = i * 977;
+         uint32_t ramp = ramp_time;
+         while (ramp >= (1 << 17)) {
+            ramp >>= 1;
+            elapsed >>= 1;
+         }
+         sink = (power * curve_lookup(curve, (elapsed << 15) / ramp)) >> 15;
+      }
+      const uint32_t curve_cycles = bench_cycles(start);
+
+      LOG_INFO("bench: ramp curve=%u float=%u lut=%u cycles/update\n", curve, float_cycles / BENCH_SAMPLES, curve_cycles / BENCH_SAMPLES);
+   }
+}
+
+void benchmark_run() {
+   LOG_INFO("Running benchmarks...\n");
+   bench_init();
+
+   bench_capture();
+   bench_swar();
+   bench_pitch();
+   bench_ramp();
+
+   LOG_INFO("Benchmarks done.\n");
+}
+
+#else
+void benchmark_run() {}
+#endif
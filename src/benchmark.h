@@ -0,0 +1,26 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+#include "swx.h"
+
+// Run the on-device benchmarks and log the results. Does nothing unless built with SWX_BENCHMARK (see BENCHMARK cmake option).
+void benchmark_run();
+
+#endif // _BENCHMARK_H
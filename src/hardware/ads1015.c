@@ -2,6 +2,7 @@
 
 #ifdef USE_ADC_ADS1015
 #include "../util/i2c.h"
+#include "driver.h"
 
 #define ADS1015_CHANNEL_COUNT (4)
 
@@ -83,12 +84,12 @@ typedef enum {
 
 static uint8_t buffer[3];
 
-static bool write_register(uint8_t reg, uint16_t value) {
+static bool write_register(const i2c_device_config_t* cfg, uint8_t reg, uint16_t value) {
    buffer[0] = reg;
    buffer[1] = value >> 8;
    buffer[2] = value & 0xFF;
 
-   int ret = i2c_write(I2C_PORT_PERIF, ADC_ADDRESS, buffer, sizeof(buffer), false, I2C_DEVICE_TIMEOUT);
+   int ret = i2c_write(cfg->i2c, cfg->address, buffer, sizeof(buffer), false, I2C_DEVICE_TIMEOUT);
    if (ret < 0) {
       LOG_ERROR("ADS1015:write_register: ret=%d - I2C write failed!\n", ret);
       return false;
@@ -96,28 +97,32 @@ static bool write_register(uint8_t reg, uint16_t value) {
    return true;
 }
 
-static uint16_t read_register(uint8_t reg) {
+static bool read_register(const i2c_device_config_t* cfg, uint8_t reg, uint16_t* value) {
    buffer[0] = reg;
 
-   int ret = i2c_write(I2C_PORT_PERIF, ADC_ADDRESS, buffer, 1, true, I2C_DEVICE_TIMEOUT);
+   int ret = i2c_write(cfg->i2c, cfg->address, buffer, 1, true, I2C_DEVICE_TIMEOUT);
    if (ret < 0) {
       LOG_ERROR("ADS1015:write_register: ret=%d - I2C write failed!\n", ret);
-      return 0;
+      return false;
    }
 
-   ret = i2c_read(I2C_PORT_PERIF, ADC_ADDRESS, buffer, 2, false, I2C_DEVICE_TIMEOUT);
+   ret = i2c_read(cfg->i2c, cfg->address, buffer, 2, false, I2C_DEVICE_TIMEOUT);
    if (ret < 0) {
       LOG_ERROR("ADS1015:read_register: ret=%d - I2C read failed!\n", ret);
-      return 0;
+      return false;
    }
 
-   return (buffer[0] << 8) | buffer[1];
+   *value = (buffer[0] << 8) | buffer[1];
+   return true;
 }
 
-void init_adc() {}
+static bool ads1015_init(const sense_driver_t* drv) {
+   (void)drv;
+   return true;
+}
 
 // Based on https://github.com/adafruit/Adafruit_ADS1X15/blob/7026e332655fbf9cb1b9523748d78324ffafd11e/Adafruit_ADS1X15.cpp
-bool adc_read_counts(uint8_t channel, uint16_t* counts) {
+static bool ads1015_read_start(const sense_driver_t* drv, uint8_t channel) {
    if (channel >= ADS1015_CHANNEL_COUNT) {
       LOG_WARN("ADS1015: ch=%u - Out of range channel index!\n", channel);
       return false;
@@ -129,34 +134,56 @@ bool adc_read_counts(uint8_t channel, uint16_t* counts) {
                      ADS1015_REG_CONFIG_CMODE_TRAD;    // Traditional comparator (default val)
 
    // config |= ADS1015_REG_CONFIG_MODE_CONTIN;     // Continuous sampling
-   config |= ADS1015_REG_CONFIG_MODE_SINGLE;                // Single shot mode
+   config |= ADS1015_REG_CONFIG_MODE_SINGLE;  // Single shot mode
 
-   config |= ADS1015_GAIN;                                  // Set PGA gain
-   config |= ADS1015_RATE;                                  // Set sample rate
-   config |= ADS1015_CHANNEL_TO_MUX[channel];               // Set mux for single ended / specified channel
+   config |= ADS1015_GAIN;                    // Set PGA gain
+   config |= ADS1015_RATE;                    // Set sample rate
+   config |= ADS1015_CHANNEL_TO_MUX[channel]; // Set mux for single ended / specified channel
 
-   config |= ADS1015_REG_CONFIG_OS_SINGLE;                  // Set single-conversion bit
+   config |= ADS1015_REG_CONFIG_OS_SINGLE;    // Set single-conversion bit
 
-   if (!write_register(ADS1015_REG_POINTER_CONFIG, config)) // Start conversion
-      return false;
+   return write_register(drv->config, ADS1015_REG_POINTER_CONFIG, config); // Start conversion
+}
 
-   // Wait for conversion to complete
-   while ((read_register(ADS1015_REG_POINTER_CONFIG) & ADS1015_REG_CONFIG_OS_MASK) == ADS1015_REG_CONFIG_OS_BUSY)
-      tight_loop_contents();
+static bool ads1015_read_complete(const sense_driver_t* drv, uint16_t* counts, bool* ok) {
+   uint16_t config;
+   if (!read_register(drv->config, ADS1015_REG_POINTER_CONFIG, &config)) {
+      *ok = false;
+      return true;
+   }
+
+   // Check if conversion is still in progress
+   if ((config & ADS1015_REG_CONFIG_OS_MASK) == ADS1015_REG_CONFIG_OS_BUSY)
+      return false;
 
    // Read conversion results
-   uint16_t res = read_register(ADS1015_REG_POINTER_CONVERT) >> 4;
+   uint16_t res;
+   *ok = read_register(drv->config, ADS1015_REG_POINTER_CONVERT, &res);
 
    // Shift 12-bit results right 4 bits, making sure we keep the sign bit intact
    //  if (res > 0x07FF) // negative number - extend the sign to 16th bit
    //   res |= 0xF000;
 
    // return (int16_t)res;
-   *counts = res;
+   if (*ok)
+      *counts = res >> 4;
    return true;
 }
 
-float adc_compute_volts(uint16_t counts) {
+static bool ads1015_read(const sense_driver_t* drv, uint8_t channel, uint16_t* counts) {
+   if (!ads1015_read_start(drv, channel))
+      return false;
+
+   // Wait for conversion to complete
+   bool ok;
+   while (!ads1015_read_complete(drv, counts, &ok))
+      tight_loop_contents();
+   return ok;
+}
+
+static float ads1015_compute_volts(const sense_driver_t* drv, uint16_t counts) {
+   (void)drv;
+
    float fsRange;
    switch (ADS1015_GAIN) {
       case ADS1015_GAIN_TWOTHIRDS:
@@ -183,4 +210,19 @@ float adc_compute_volts(uint16_t counts) {
    return counts * (fsRange / 2048);
 }
 
+static const i2c_device_config_t ads1015_config = {.i2c = I2C_PORT_PERIF, .address = ADC_ADDRESS};
+
+// The ADS1015 has a single converter behind the input mux, so batches are sequential conversions (no read_batch)
+const sense_driver_t ads1015_driver = {
+    .name = "ADS1015",
+    .config = &ads1015_config,
+    .channel_count = ADS1015_CHANNEL_COUNT,
+    .sample_time_us = 450, // config write (~90 us at 400 kHz) + single shot conversion (~330 us at 3300 SPS)
+    .init = ads1015_init,
+    .read = ads1015_read,
+    .read_start = ads1015_read_start,
+    .read_complete = ads1015_read_complete,
+    .compute_volts = ads1015_compute_volts,
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _DRIVER_H
+#define _DRIVER_H
+
+#include "../swx.h"
+
+#include <hardware/i2c.h>
+
+typedef struct level_driver level_driver_t;
+typedef struct sense_driver sense_driver_t;
+
+// Level DAC driver, sets the output power level of one or more channels.
+// Each driver instance is a single device, with device specific settings (e.g. I2C port/address) in config.
+struct level_driver {
+   const char* name;
+   const void* config;
+
+   uint8_t channel_count;
+   uint16_t max_value;
+
+   bool (*init)(const level_driver_t* drv);
+
+   // Set the level of a single device channel.
+   bool (*write)(const level_driver_t* drv, uint8_t channel, uint16_t value);
+
+   // Set the level of count device channels, in as few bus transactions as the device allows. Optional.
+   bool (*write_batch)(const level_driver_t* drv, const uint8_t* channels, const uint16_t* values, uint8_t count);
+};
+
+// Sense ADC driver, measures channel output feedback.
+// Each driver instance is a single device, with device specific settings (e.g. I2C port/address) in config.
+struct sense_driver {
+   const char* name;
+   const void* config;
+
+   uint8_t channel_count;
+   uint16_t sample_time_us; // time from starting a read until the input has been sampled, the input must be steady until then
+
+   bool (*init)(const sense_driver_t* drv);
+
+   // Blocking read of a single device channel.
+   bool (*read)(const sense_driver_t* drv, uint8_t channel, uint16_t* counts);
+
+   // Blocking read of count device channels (channels may repeat). Optional.
+   bool (*read_batch)(const sense_driver_t* drv, const uint8_t* channels, uint16_t* counts, uint8_t count);
+
+   // Start a conversion without waiting for it. Optional, but must be provided along with read_complete.
+   bool (*read_start)(const sense_driver_t* drv, uint8_t channel);
+
+   // Returns true once the conversion started by read_start has finished. On success counts contains the result,
+   // otherwise ok is set false. Returns false while the conversion is still in progress.
+   bool (*read_complete)(const sense_driver_t* drv, uint16_t* counts, bool* ok);
+
+   float (*compute_volts)(const sense_driver_t* drv, uint16_t counts);
+};
+
+// Device settings for I2C based drivers
+typedef struct {
+   i2c_inst_t* i2c;
+   uint8_t address;
+} i2c_device_config_t;
+
+static inline bool level_write_batch(const level_driver_t* drv, const uint8_t* channels, const uint16_t* values, uint8_t count) {
+   if (drv->write_batch)
+      return drv->write_batch(drv, channels, values, count);
+
+   bool success = true;
+   for (uint8_t i = 0; i < count; i++)
+      success &= drv->write(drv, channels[i], values[i]);
+   return success;
+}
+
+static inline bool sense_read_batch(const sense_driver_t* drv, const uint8_t* channels, uint16_t* counts, uint8_t count) {
+   if (drv->read_batch)
+      return drv->read_batch(drv, channels, counts, count);
+
+   for (uint8_t i = 0; i < count; i++) {
+      if (!drv->read(drv, channels[i], &counts[i]))
+         return false;
+   }
+   return true;
+}
+
+static inline bool sense_is_async(const sense_driver_t* drv) {
+   return drv->read_start && drv->read_complete;
+}
+
+// Available driver instances, using the board device settings (see boards folder)
+extern const level_driver_t mcp4728_driver;
+extern const level_driver_t sim_level_driver;
+
+extern const sense_driver_t ads1015_driver;
+extern const sense_driver_t rp2040_adc_driver;
+extern const sense_driver_t sim_sense_driver;
+
+// Default drivers used for channels, boards can override per channel with CHn_DAC_DRIVER/CHn_ADC_DRIVER
+#ifndef CH_DAC_DRIVER
+#if defined(USE_DAC_MCP4728)
+#define CH_DAC_DRIVER (&mcp4728_driver)
+#elif defined(USE_DAC_SIM)
+#define CH_DAC_DRIVER (&sim_level_driver)
+#else
+#error "No level DAC driver! Define USE_DAC_MCP4728, USE_DAC_SIM or CH_DAC_DRIVER in board config."
+#endif
+#endif
+
+#ifndef CH_ADC_DRIVER
+#if defined(USE_ADC_ADS1015)
+#define CH_ADC_DRIVER (&ads1015_driver)
+#elif defined(USE_ADC_RP2040)
+#define CH_ADC_DRIVER (&rp2040_adc_driver)
+#elif defined(USE_ADC_SIM)
+#define CH_ADC_DRIVER (&sim_sense_driver)
+#else
+#error "No sense ADC driver! Define USE_ADC_ADS1015, USE_ADC_RP2040, USE_ADC_SIM or CH_ADC_DRIVER in board config."
+#endif
+#endif
+
+#endif // _DRIVER_H
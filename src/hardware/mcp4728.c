@@ -3,6 +3,7 @@
 #ifdef USE_DAC_MCP4728
 #include "../util/i2c.h"
 #include "../util/gpio.h"
+#include "driver.h"
 
 #define MCP4728_MAX_VALUE (4095)
 #define MCP4728_CHANNEL_COUNT (4)
@@ -19,23 +20,18 @@ typedef enum { MCP4728_PD_NORMAL = 0, MCP4728_PD_GND_1K, MCP4728_PD_GND_100K, MC
 #define MCP4728_PD (MCP4728_PD_NORMAL)
 #define MCP4728_UDAC (false)
 
-void init_dac() {
+#define MCP4728_WRITE_SIZE (3) // bytes per channel for a multi-write
+
+static bool mcp4728_init(const level_driver_t* drv) {
+   (void)drv;
 #ifdef PIN_LDAC
    init_gpio(PIN_LDAC, GPIO_OUT, 0); // active low
 #endif
+   return true;
 }
 
-// Based on https://github.com/adafruit/Adafruit_MCP4728/blob/6d389cd87a8bd1e898136b4425c55ca7b83eccee/Adafruit_MCP4728.cpp
-bool set_dac_direct(uint8_t channel, uint16_t value) {
-   uint8_t buffer[3];
-
-#ifdef I2C_CHECK_WRITE
-   if (i2c_get_write_available(I2C_PORT_PERIF) < sizeof(buffer)) { // Check if we can write without blocking
-      LOG_WARN("MCP4728 - I2C buffer full!\n");
-      return false;
-   }
-#endif
-
+// Encode a multi-write entry for a single channel into dst (MCP4728_WRITE_SIZE bytes)
+static bool encode_write(uint8_t* dst, uint8_t channel, uint16_t value) {
    if (channel >= MCP4728_CHANNEL_COUNT) {
       LOG_WARN("MCP4728: ch=%u - Out of range channel index!\n", channel);
       return false;
@@ -49,20 +45,66 @@ bool set_dac_direct(uint8_t channel, uint16_t value) {
    // ------------------------------------------------------------------------------------------------
    // C2 C1 C0 W1 W2 DAC1 DAC0 ~UDAC [A] VREF PD1 PD0 Gx D11 D10 D9 D8 [A] D7 D6 D5 D4 D3 D2 D1 D0 [A]
 
-   buffer[0] = MCP4728_CMD_WRITE_MULTI_IR | (channel << 1) | MCP4728_UDAC;
+   dst[0] = MCP4728_CMD_WRITE_MULTI_IR | (channel << 1) | MCP4728_UDAC;
 
    value |= MCP4728_VREF << 15;
    value |= MCP4728_PD << 13;
    value |= MCP4728_GAIN << 12;
 
-   buffer[1] = value >> 8;
-   buffer[2] = value & 0xFF;
+   dst[1] = value >> 8;
+   dst[2] = value & 0xFF;
+   return true;
+}
+
+// Based on https://github.com/adafruit/Adafruit_MCP4728/blob/6d389cd87a8bd1e898136b4425c55ca7b83eccee/Adafruit_MCP4728.cpp
+// Multi-write entries are sequential within a single I2C transaction, so all channels can be set with one address phase.
+static bool mcp4728_write_batch(const level_driver_t* drv, const uint8_t* channels, const uint16_t* values, uint8_t count) {
+   const i2c_device_config_t* cfg = drv->config;
+   uint8_t buffer[MCP4728_WRITE_SIZE * MCP4728_CHANNEL_COUNT];
+
+   if (count == 0)
+      return true;
 
-   int ret = i2c_write(I2C_PORT_PERIF, DAC_ADDRESS, buffer, sizeof(buffer), false, I2C_DEVICE_TIMEOUT);
+   if (count > MCP4728_CHANNEL_COUNT) {
+      LOG_WARN("MCP4728: count=%u - Too many channels in batch!\n", count);
+      return false;
+   }
+
+   const size_t len = MCP4728_WRITE_SIZE * count;
+
+#ifdef I2C_CHECK_WRITE
+   if (i2c_get_write_available(cfg->i2c) < len) { // Check if we can write without blocking
+      LOG_WARN("MCP4728 - I2C buffer full!\n");
+      return false;
+   }
+#endif
+
+   for (uint8_t i = 0; i < count; i++) {
+      if (!encode_write(&buffer[MCP4728_WRITE_SIZE * i], channels[i], values[i]))
+         return false;
+   }
+
+   int ret = i2c_write(cfg->i2c, cfg->address, buffer, len, false, I2C_DEVICE_TIMEOUT);
    if (ret < 0) {
       LOG_ERROR("MCP4728: ret=%d - I2C write failed!\n", ret);
       return false;
    }
    return true;
 }
+
+static bool mcp4728_write(const level_driver_t* drv, uint8_t channel, uint16_t value) {
+   return mcp4728_write_batch(drv, &channel, &value, 1);
+}
+
+static const i2c_device_config_t mcp4728_config = {.i2c = I2C_PORT_PERIF, .address = DAC_ADDRESS};
+
+const level_driver_t mcp4728_driver = {
+    .name = "MCP4728",
+    .config = &mcp4728_config,
+    .channel_count = MCP4728_CHANNEL_COUNT,
+    .max_value = MCP4728_MAX_VALUE,
+    .init = mcp4728_init,
+    .write = mcp4728_write,
+    .write_batch = mcp4728_write_batch,
+};
 #endif
\ No newline at end of file
@@ -0,0 +1,41 @@
+#include "../swx.h"
+
+#ifdef USE_ADC_RP2040
+#include "../analog_capture.h"
+#include "driver.h"
+
+#define RP2040_ADC_CHANNEL_COUNT (4) // ADC inputs 0-3 (GPIO 26-29)
+#define RP2040_ADC_VREF (3.3f)
+
+// The internal ADC is free running for analog capture, so sense channels are read from the capture stream instead of
+// starting a conversion. The sense input must be one of the captured inputs.
+
+static bool rp2040_adc_init(const sense_driver_t* drv) {
+   (void)drv;
+   return true;
+}
+
+static bool rp2040_adc_read(const sense_driver_t* drv, uint8_t channel, uint16_t* counts) {
+   (void)drv;
+   if (channel >= RP2040_ADC_CHANNEL_COUNT) {
+      LOG_WARN("RP2040 ADC: ch=%u - Out of range channel index!\n", channel);
+      return false;
+   }
+   return analog_capture_latest(channel, counts);
+}
+
+static float rp2040_adc_compute_volts(const sense_driver_t* drv, uint16_t counts) {
+   (void)drv;
+   return counts * (RP2040_ADC_VREF / 4096);
+}
+
+const sense_driver_t rp2040_adc_driver = {
+    .name = "RP2040 ADC",
+    .channel_count = RP2040_ADC_CHANNEL_COUNT,
+    .sample_time_us = 0, // latest capture sample, already taken
+    .init = rp2040_adc_init,
+    .read = rp2040_adc_read,
+    .compute_volts = rp2040_adc_compute_volts,
+};
+
+#endif
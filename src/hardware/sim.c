@@ -0,0 +1,73 @@
+#include "../swx.h"
+
+#if defined(USE_DAC_SIM) || defined(USE_ADC_SIM)
+#include "driver.h"
+
+// Simulated level DAC and sense ADC, for bring-up and testing on boards without output hardware.
+// The sense reading is modelled as a resistive load driven by the simulated level, so the calibration and regulation paths can run.
+
+#define SIM_CHANNEL_COUNT (4)
+#define SIM_MAX_VALUE (4095)
+
+#ifndef SIM_SENSE_LOAD
+#define SIM_SENSE_LOAD (64) // Q8, sense counts per DAC step below SIM_MAX_VALUE
+#endif
+
+static volatile uint16_t sim_levels[SIM_CHANNEL_COUNT] = {SIM_MAX_VALUE, SIM_MAX_VALUE, SIM_MAX_VALUE, SIM_MAX_VALUE};
+
+#ifdef USE_DAC_SIM
+static bool sim_level_init(const level_driver_t* drv) {
+   (void)drv;
+   return true;
+}
+
+static bool sim_level_write(const level_driver_t* drv, uint8_t channel, uint16_t value) {
+   (void)drv;
+   if (channel >= SIM_CHANNEL_COUNT)
+      return false;
+
+   sim_levels[channel] = value > SIM_MAX_VALUE ? SIM_MAX_VALUE : value;
+   return true;
+}
+
+const level_driver_t sim_level_driver = {
+    .name = "SIM DAC",
+    .channel_count = SIM_CHANNEL_COUNT,
+    .max_value = SIM_MAX_VALUE,
+    .init = sim_level_init,
+    .write = sim_level_write,
+};
+#endif
+
+#ifdef USE_ADC_SIM
+static bool sim_sense_init(const sense_driver_t* drv) {
+   (void)drv;
+   return true;
+}
+
+static bool sim_sense_read(const sense_driver_t* drv, uint8_t channel, uint16_t* counts) {
+   (void)drv;
+   if (channel >= SIM_CHANNEL_COUNT)
+      return false;
+
+   const uint32_t value = ((uint32_t)(SIM_MAX_VALUE - sim_levels[channel]) * SIM_SENSE_LOAD) >> 8;
+   *counts = value > SIM_MAX_VALUE ? SIM_MAX_VALUE : value;
+   return true;
+}
+
+static float sim_sense_compute_volts(const sense_driver_t* drv, uint16_t counts) {
+   (void)drv;
+   return counts * (3.3f / 4096);
+}
+
+const sense_driver_t sim_sense_driver = {
+    .name = "SIM ADC",
+    .channel_count = SIM_CHANNEL_COUNT,
+    .sample_time_us = 0,
+    .init = sim_sense_init,
+    .read = sim_sense_read,
+    .compute_volts = sim_sense_compute_volts,
+};
+#endif
+
+#endif
@@ -26,7 +26,11 @@
 #include "protocol.h"
 #include "analog_capture.h"
 #include "pulse_gen.h"
+#include "audio.h"
 #include "trigger.h"
+#include "timers.h"
+#include "action.h"
+#include "benchmark.h"
 
 #include "util/i2c.h"
 #include "util/gpio.h"
@@ -67,13 +71,6 @@ static void init() {
    gpio_pull_up(PIN_I2C_SCL_PERIF);
 #endif
 
-   // Init external DAC and ADC
-   extern void init_dac();
-   init_dac();
-
-   extern void init_adc();
-   init_adc();
-
    analog_capture_init();
    analog_capture_start();
 }
@@ -82,6 +79,8 @@ int main() {
    // Initialize hardware
    init();
 
+   benchmark_run(); // no-op unless built with BENCHMARK
+
    // Initialize output channels and needed subsystems
    output_init();
 
@@ -95,7 +94,9 @@ int main() {
 
    pulse_gen_init();
    
+   actions_init();
    triggers_init();
+   timers_init();
 
    LOG_DEBUG("Starting core0 loop...\n");
 
@@ -108,7 +109,10 @@ int main() {
 
       pulse_gen_process();
       output_process_pulses();
+      audio_process_sources();
       triggers_process();
+      timers_process();
+      actions_process();
    }
 
    // Code execution shouldn't get this far...
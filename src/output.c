@@ -18,6 +18,7 @@
 #include "output.h"
 
 #include <pico/util/queue.h>
+#include <hardware/sync.h>
 
 #include "util/i2c.h"
 #include "util/gpio.h"
@@ -25,11 +26,11 @@
 #include "channel.h"
 #include "state.h"
 
+#include "hardware/driver.h"
+
 #include "pulse_gen.pio.h"
 #define CHANNEL_PIO_PROGRAM (pio_pulse_gen_program)
 
-#define DAC_MAX_VALUE (4095) // Assume DAC is 12-bit // TODO: Move to a better location
-
 #if defined(ADC_MEAN) && defined(ADC_MEAN_TRIM_AMOUNT)
 #define USE_ADC_MEAN
 #endif
@@ -74,6 +75,48 @@
 #endif
 #endif
 
+#ifndef CH1_DAC_DRIVER
+#define CH1_DAC_DRIVER (CH_DAC_DRIVER)
+#endif
+#ifndef CH2_DAC_DRIVER
+#define CH2_DAC_DRIVER (CH_DAC_DRIVER)
+#endif
+#ifndef CH3_DAC_DRIVER
+#define CH3_DAC_DRIVER (CH_DAC_DRIVER)
+#endif
+#ifndef CH4_DAC_DRIVER
+#define CH4_DAC_DRIVER (CH_DAC_DRIVER)
+#endif
+
+#ifndef CH1_ADC_DRIVER
+#define CH1_ADC_DRIVER (CH_ADC_DRIVER)
+#endif
+#ifndef CH2_ADC_DRIVER
+#define CH2_ADC_DRIVER (CH_ADC_DRIVER)
+#endif
+#ifndef CH3_ADC_DRIVER
+#define CH3_ADC_DRIVER (CH_ADC_DRIVER)
+#endif
+#ifndef CH4_ADC_DRIVER
+#define CH4_ADC_DRIVER (CH_ADC_DRIVER)
+#endif
+
+#ifndef CH_REG_PERIOD_US
+#define CH_REG_PERIOD_US (2000) // Closed-loop regulation update period per channel
+#endif
+
+#ifndef CH_REG_SETTLE_US
+#define CH_REG_SETTLE_US (50) // Time after the gates switch on before sense is sampled, same as calibration
+#endif
+
+#ifndef CH_REG_SYNC_TIMEOUT_US
+#define CH_REG_SYNC_TIMEOUT_US (50000) // Max wait for a pulse long enough to sample, channels without one run open-loop
+#endif
+
+#ifndef CH_REG_CEILING_MARGIN
+#define CH_REG_CEILING_MARGIN (50) // Power levels the loop can drive above the requested power, when no ceiling is set
+#endif
+
 #ifdef CH_CAL_OFFSET
 #ifndef CH1_CAL_OFFSET
 #define CH1_CAL_OFFSET (CH_CAL_OFFSET)
@@ -89,23 +132,31 @@
 #endif
 #endif
 
-#define CH(pinGateA, pinGateB, dacChannel, adcChannel, pio_hw, sm_index, calThresholdOk, calThresholdOver, calOffset)                                                    \
+#define CH(pinGateA, pinGateB, dacDriver, dacChannel, adcDriver, adcChannel, pio_hw, sm_index, calThresholdOk, calThresholdOver, calOffset)                              \
    {                                                                                                                                                                     \
-      .pin_gate_a = (pinGateA), .pin_gate_b = (pinGateB), .dac_channel = (dacChannel), .adc_channel = (adcChannel), .pio = (pio_hw), .sm = (sm_index),                   \
-      .cal_threshold_ok = (calThresholdOk), .cal_threshold_over = (calThresholdOver), .cal_offset = (calOffset)                                                          \
+      .pin_gate_a = (pinGateA), .pin_gate_b = (pinGateB), .dac = (dacDriver), .dac_channel = (dacChannel), .adc = (adcDriver), .adc_channel = (adcChannel),             \
+      .pio = (pio_hw), .sm = (sm_index), .cal_threshold_ok = (calThresholdOk), .cal_threshold_over = (calThresholdOver), .cal_offset = (calOffset)                       \
    }
 
-// External DAC/ADC interface functions
-extern bool set_dac_direct(uint8_t channel, uint16_t value);
-
-extern float adc_compute_volts(uint16_t counts);
-extern bool adc_read_counts(uint8_t channel, uint16_t* counts);
-
 typedef struct {
    uint8_t channel;
    uint16_t power;
 } pwr_cmd_t;
 
+// Gate on window of the last pulse started on a channel. Written by core0, read by core1 (see publish_gate_window).
+typedef struct {
+   volatile uint32_t sequence; // odd while the window is being written
+   volatile uint32_t start_us;
+   volatile uint32_t length_us;
+} gate_window_t;
+
+typedef struct {
+   uint16_t power;    // requested power level, used as the loop feed forward
+   int32_t drive;     // commanded power level (Q8)
+   int32_t integral;  // PI integrator (Q8)
+   int16_t dac_value; // last value written to the DAC, -1 if unknown
+} regulator_t;
+
 typedef struct {
    uint32_t abs_time_us;
 
@@ -119,8 +170,11 @@ typedef struct {
    const uint8_t pin_gate_a; // GPIO pin for NFET gate A
    const uint8_t pin_gate_b; // GPIO pin for NFET gate B
 
-   const uint8_t dac_channel;
-   const uint8_t adc_channel;
+   const level_driver_t* const dac; // Level DAC device
+   const uint8_t dac_channel;       // Level DAC device channel
+
+   const sense_driver_t* const adc; // Sense ADC device
+   const uint8_t adc_channel;       // Sense ADC device channel
 
    const PIO pio;                  // Hardware PIO instance
    const int sm;                   // PIO state machine index
@@ -131,15 +185,17 @@ typedef struct {
 } channel_def_t;
 
 static float read_voltage(const channel_def_t* ch);
+static void write_levels(uint8_t channel_mask);
+static uint8_t regulate_power();
 
 static const channel_def_t channels[CHANNEL_COUNT] = {
-    CH(PIN_CH1_GA, PIN_CH1_GB, CH1_DAC_CHANNEL, CH1_ADC_CHANNEL, pio0, 0, CH1_CAL_THRESHOLD_OK, CH1_CAL_THRESHOLD_OVER, CH1_CAL_OFFSET),
+    CH(PIN_CH1_GA, PIN_CH1_GB, CH1_DAC_DRIVER, CH1_DAC_CHANNEL, CH1_ADC_DRIVER, CH1_ADC_CHANNEL, pio0, 0, CH1_CAL_THRESHOLD_OK, CH1_CAL_THRESHOLD_OVER, CH1_CAL_OFFSET),
 #if CHANNEL_COUNT > 1
-    CH(PIN_CH2_GA, PIN_CH2_GB, CH2_DAC_CHANNEL, CH2_ADC_CHANNEL, pio0, 1, CH2_CAL_THRESHOLD_OK, CH2_CAL_THRESHOLD_OVER, CH2_CAL_OFFSET),
+    CH(PIN_CH2_GA, PIN_CH2_GB, CH2_DAC_DRIVER, CH2_DAC_CHANNEL, CH2_ADC_DRIVER, CH2_ADC_CHANNEL, pio0, 1, CH2_CAL_THRESHOLD_OK, CH2_CAL_THRESHOLD_OVER, CH2_CAL_OFFSET),
 #if CHANNEL_COUNT > 2
-    CH(PIN_CH3_GA, PIN_CH3_GB, CH3_DAC_CHANNEL, CH3_ADC_CHANNEL, pio0, 2, CH3_CAL_THRESHOLD_OK, CH3_CAL_THRESHOLD_OVER, CH3_CAL_OFFSET),
+    CH(PIN_CH3_GA, PIN_CH3_GB, CH3_DAC_DRIVER, CH3_DAC_CHANNEL, CH3_ADC_DRIVER, CH3_ADC_CHANNEL, pio0, 2, CH3_CAL_THRESHOLD_OK, CH3_CAL_THRESHOLD_OVER, CH3_CAL_OFFSET),
 #if CHANNEL_COUNT > 3
-    CH(PIN_CH4_GA, PIN_CH4_GB, CH4_DAC_CHANNEL, CH4_ADC_CHANNEL, pio0, 3, CH4_CAL_THRESHOLD_OK, CH4_CAL_THRESHOLD_OVER, CH4_CAL_OFFSET),
+    CH(PIN_CH4_GA, PIN_CH4_GB, CH4_DAC_DRIVER, CH4_DAC_CHANNEL, CH4_ADC_DRIVER, CH4_ADC_CHANNEL, pio0, 3, CH4_CAL_THRESHOLD_OK, CH4_CAL_THRESHOLD_OVER, CH4_CAL_OFFSET),
 #endif
 #endif
 #endif
@@ -150,6 +206,25 @@ static int pio_offsets[NUM_PIOS] = {-1}; // Lookup Table: PIO index -> PIO progr
 static queue_t pulse_queue;
 static queue_t power_queue;
 
+static regulator_t regulators[CHANNEL_COUNT]; // only accessed by core1 after init
+static gate_window_t gate_windows[CHANNEL_COUNT];
+static uint32_t gate_end_us[CHANNEL_COUNT]; // end of the last pulse sent to each channel, only accessed by core0
+
+// Latest sense reading of each channel, written by core1. Halfword stores are atomic, so core0 never sees a partial update.
+static volatile uint16_t sense_counts[CHANNEL_COUNT];
+
+// Regulation round state. Each round samples the sense of every ready channel, then sets the new levels of regulated channels in one batch.
+static struct {
+   uint8_t pending;   // channels still to be sampled this round
+   uint8_t regulated; // channels running closed-loop this round
+   uint8_t synced;    // channels sampled inside a pulse this round
+   uint8_t updated;   // channels with a new drive level this round
+   uint8_t closed;    // channels regulated using a sense reading this round
+   int8_t converting; // channel with an async sense conversion in progress, -1 if none
+
+   uint32_t start_time_us;
+} reg_round = {.converting = -1};
+
 static pulse_t pulse;           // current pulse
 static bool fetch_pulse = true; // if true, fetch next pulse from pulse_queue
 
@@ -168,6 +243,28 @@ void output_init() {
    // Print I2C devices found on bus
    i2c_scan(I2C_PORT_PERIF); // TODO: Validate missing I2C peripheral devices
 
+   for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
+      const channel_def_t* ch = &channels[ch_index];
+
+      // Init level/sense devices, once per device since channels can share them
+      bool dac_init = true;
+      bool adc_init = true;
+      for (uint8_t i = 0; i < ch_index; i++) {
+         dac_init &= channels[i].dac != ch->dac;
+         adc_init &= channels[i].adc != ch->adc;
+      }
+      if (dac_init) {
+         LOG_DEBUG("Init level driver: %s\n", ch->dac->name);
+         if (!ch->dac->init(ch->dac))
+            LOG_ERROR("Level driver init failed! %s - ERROR!\n", ch->dac->name);
+      }
+      if (adc_init) {
+         LOG_DEBUG("Init sense driver: %s\n", ch->adc->name);
+         if (!ch->adc->init(ch->adc))
+            LOG_ERROR("Sense driver init failed! %s - ERROR!\n", ch->adc->name);
+      }
+   }
+
    for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
       const channel_def_t* ch = &channels[ch_index];
       LOG_DEBUG("Init channel: pio=%u sm=%d\n", pio_get_index(ch->pio), ch->sm);
@@ -177,7 +274,7 @@ void output_init() {
       init_gpio(ch->pin_gate_b, GPIO_OUT, 0);
 
       // Switch off power
-      set_dac_direct(ch->dac_channel, DAC_MAX_VALUE);
+      ch->dac->write(ch->dac, ch->dac_channel, ch->dac->max_value);
 
       // Load PIO program if not already loaded
       const uint pio_index = pio_get_index(ch->pio);
@@ -193,6 +290,15 @@ void output_init() {
       pio_sm_claim(ch->pio, ch->sm);
 
       set_state(REG_CHn_STATUS + ch_index, CHANNEL_UNCALIBRATED);
+
+      // Regulation loop defaults, full scale is board specific so loop stays open until it is set
+      const uint16_t offset = CH_REG_SIZE * ch_index;
+      set_state16(REG_CHn_REG_KP_w + offset, 64);   // 0.25 levels/count
+      set_state16(REG_CHn_REG_KI_w + offset, 16);   // 0.0625 levels/count/update
+      set_state16(REG_CHn_REG_SLEW_w + offset, 20); // 10 levels/ms at the default update period
+      set_state16(REG_CHn_REG_CEILING_w + offset, 0);  // requested power + CH_REG_CEILING_MARGIN
+
+      regulators[ch_index].dac_value = -1;
    }
 
    fetch_pulse = true;
@@ -249,7 +355,7 @@ bool output_calibrate_all() {
          LOG_DEBUG("Precalibration voltage: pio=%u sm=%d voltage=%.3fv - OK\n", pio_index, ch->sm, voltage);
 
          for (uint16_t dacValue = 4000; dacValue > 2000; dacValue -= 10) {
-            set_dac_direct(ch->dac_channel, dacValue);
+            ch->dac->write(ch->dac, ch->dac_channel, dacValue);
             sleep_us(100); // Stabilize
 
             // Switch on both nfets
@@ -283,13 +389,14 @@ bool output_calibrate_all() {
       }
 
       // Switch off power
-      set_dac_direct(ch->dac_channel, DAC_MAX_VALUE);
+      ch->dac->write(ch->dac, ch->dac_channel, ch->dac->max_value);
+      regulators[ch_index].dac_value = -1;
 
 #ifdef CH_IGNORE_CAL_ERRORS
       // If errors, ignore and use max range for calibration values. Warning: Output driver could be overdriven at higher power levels
       if (get_state(ch_status) != CHANNEL_READY) {
          LOG_WARN("Ignoring calibration! Using default calibration! pio=%u sm=%d\n", pio_index, ch->sm);
-         set_state16(ch_cal_value, DAC_MAX_VALUE - ch->cal_offset);
+         set_state16(ch_cal_value, ch->dac->max_value - ch->cal_offset);
          set_state(ch_status, CHANNEL_READY);
       }
 #endif
@@ -317,6 +424,30 @@ bool output_calibrate_all() {
    return success;
 }
 
+// Publish the gate on window of a pulse to core1. Sequence lock, so the reader never sees a start and length from different pulses.
+static inline void publish_gate_window(uint8_t ch_index, uint32_t start_us, uint32_t length_us) {
+   gate_window_t* w = &gate_windows[ch_index];
+   w->sequence++;
+   __dmb();
+   w->start_us = start_us;
+   w->length_us = length_us;
+   __dmb();
+   w->sequence++;
+}
+
+// Read the gate on window of the last pulse started on the channel. Returns false if it was being written.
+static inline bool read_gate_window(uint8_t ch_index, uint32_t* start_us, uint32_t* length_us) {
+   const gate_window_t* w = &gate_windows[ch_index];
+   const uint32_t sequence = w->sequence;
+   if (sequence & 1)
+      return false;
+   __dmb();
+   *start_us = w->start_us;
+   *length_us = w->length_us;
+   __dmb();
+   return w->sequence == sequence;
+}
+
 void output_process_pulses() {
    if (fetch_pulse) {
       if (queue_try_remove(&pulse_queue, &pulse)) {
@@ -336,8 +467,20 @@ void output_process_pulses() {
             if (pulse.neg_us > PW_MAX)
                pulse.neg_us = PW_MAX;
 
+            // The pulse starts now if the state machine is idle, otherwise its start time isn't known
+            const uint32_t time = time_us_32();
+            const bool idle = pio_sm_is_tx_fifo_empty(ch->pio, ch->sm) && (int32_t)(time - gate_end_us[pulse.channel]) >= 0;
+
             uint32_t val = (pulse.pos_us << PULSE_GEN_BITS) | (pulse.neg_us);
             pio_sm_put(ch->pio, ch->sm, val);
+
+            const uint32_t length_us = pulse.pos_us + pulse.neg_us; // PIO runs 1 us per count
+            if (idle) {
+               gate_end_us[pulse.channel] = time + length_us;
+               publish_gate_window(pulse.channel, time, length_us);
+            } else {
+               gate_end_us[pulse.channel] += length_us;
+            }
          } else {
             LOG_WARN("PIO pulse queue full! pio=%u sm=%d\n", pio_get_index(ch->pio), ch->sm);
          }
@@ -348,28 +491,271 @@ void output_process_pulses() {
 }
 
 void output_process_power() {
+   // Drain all queued commands, so channels sharing a level device are set in one batch
+   uint8_t open_loop = 0;
    pwr_cmd_t cmd;
-   if (queue_try_remove(&power_queue, &cmd)) {
-      const channel_def_t* ch = &channels[cmd.channel];
-
-      if (get_state(REG_CHn_STATUS + cmd.channel) != CHANNEL_READY)
-         return;
-
+   while (queue_try_remove(&power_queue, &cmd)) {
       if (cmd.power > CHANNEL_POWER_MAX)
          cmd.power = CHANNEL_POWER_MAX;
 
-      const uint16_t cal_value = get_state16(REG_CHn_CAL_VALUE_w + (cmd.channel * 2));
-      int16_t dacValue = (cal_value + ch->cal_offset) - (cmd.power * 2);
+      regulator_t* r = &regulators[cmd.channel];
+      r->power = cmd.power;
 
-      if (dacValue < 0 || dacValue > DAC_MAX_VALUE) {
-         LOG_ERROR("Invalid power calculated! pio=%u sm=%d pwr=%u dac=%d - ERROR!\n", pio_get_index(ch->pio), ch->sm, cmd.power, dacValue);
-         return;
+      // Open-loop channels are set directly, regulated channels pick up the new power on the next loop update
+      if (!(get_state(REG_CH_REG_ENABLE) & (1 << cmd.channel))) {
+         r->drive = cmd.power << 8;
+         open_loop |= 1 << cmd.channel;
       }
+   }
+
+   write_levels(open_loop | regulate_power());
+}
 
-      // LOG_FINE("Setting power: pio=%u sm=%d pwr=%u dac=%u\n", pio_get_index(ch->pio), ch->sm, power, dacValue);
+// Calculate the channel DAC level for the given power level (Q8), using the channel calibration value
+static bool compute_dac_value(uint8_t ch_index, int32_t drive, uint16_t* value) {
+   const channel_def_t* ch = &channels[ch_index];
 
-      set_dac_direct(ch->dac_channel, (uint16_t)dacValue);
+   if (get_state(REG_CHn_STATUS + ch_index) != CHANNEL_READY)
+      return false;
+
+   const uint16_t cal_value = get_state16(REG_CHn_CAL_VALUE_w + (ch_index * 2));
+   const int32_t dacValue = (cal_value + ch->cal_offset) - (drive >> 7); // 2 DAC steps per power level
+
+   if (dacValue < 0 || dacValue > ch->dac->max_value) {
+      LOG_ERROR("Invalid power calculated! pio=%u sm=%d pwr=%u dac=%d - ERROR!\n", pio_get_index(ch->pio), ch->sm, drive >> 8, dacValue);
+      return false;
    }
+
+   *value = dacValue;
+   return true;
+}
+
+// Set the DAC level of all channels in mask from the channel drive level, batching channels that share a level device
+static void write_levels(uint8_t channel_mask) {
+   for (uint8_t first = 0; first < CHANNEL_COUNT && channel_mask; first++) {
+      if (!(channel_mask & (1 << first)))
+         continue;
+
+      const level_driver_t* dac = channels[first].dac;
+
+      uint8_t count = 0;
+      uint8_t indices[CHANNEL_COUNT];
+      uint8_t dac_channels[CHANNEL_COUNT];
+      uint16_t values[CHANNEL_COUNT];
+
+      for (uint8_t ch_index = first; ch_index < CHANNEL_COUNT; ch_index++) {
+         const channel_def_t* ch = &channels[ch_index];
+         if (!(channel_mask & (1 << ch_index)) || ch->dac != dac)
+            continue;
+         channel_mask &= ~(1 << ch_index);
+
+         uint16_t value;
+         if (!compute_dac_value(ch_index, regulators[ch_index].drive, &value) || regulators[ch_index].dac_value == value)
+            continue; // skip the write if the level hasn't changed
+
+         // LOG_FINE("Setting power: pio=%u sm=%d pwr=%u dac=%u\n", pio_get_index(ch->pio), ch->sm, regulators[ch_index].drive >> 8, value);
+
+         indices[count] = ch_index;
+         dac_channels[count] = ch->dac_channel;
+         values[count] = value;
+         count++;
+      }
+
+      if (count == 0)
+         continue;
+
+      const bool success = level_write_batch(dac, dac_channels, values, count);
+      for (uint8_t i = 0; i < count; i++)
+         regulators[indices[i]].dac_value = success ? values[i] : -1;
+   }
+}
+
+// Fixed-point PI update for a single channel, using the sense reading in counts
+static void regulate_channel(uint8_t ch_index, uint16_t counts) {
+   regulator_t* r = &regulators[ch_index];
+   const uint16_t offset = CH_REG_SIZE * ch_index;
+
+   if (r->power == 0) { // nothing to regulate, switch off
+      r->integral = 0;
+      r->drive = 0;
+      set_state16(REG_CHn_REG_ERROR_w + (ch_index * 2), 0);
+      return;
+   }
+
+   // Without a ceiling, the loop is limited to just above the requested power so a bad full scale or reading can't run away
+   uint32_t ceiling = get_state16(REG_CHn_REG_CEILING_w + offset);
+   if (ceiling == 0)
+      ceiling = r->power + CH_REG_CEILING_MARGIN;
+   if (ceiling > CHANNEL_POWER_MAX)
+      ceiling = CHANNEL_POWER_MAX;
+   const int32_t drive_max = ceiling << 8;
+   const int32_t slew = get_state16(REG_CHn_REG_SLEW_w + offset) << 8;
+
+   const uint16_t full_scale = get_state16(REG_CHn_REG_FULL_SCALE_w + offset);
+   const int32_t setpoint = ((uint32_t)r->power * full_scale) / CHANNEL_POWER_MAX;
+   int32_t error = setpoint - counts;
+   if (error > INT16_MAX)
+      error = INT16_MAX;
+   else if (error < INT16_MIN)
+      error = INT16_MIN;
+
+   const int32_t integral = r->integral + (int32_t)get_state16(REG_CHn_REG_KI_w + offset) * error;
+   int32_t drive = (r->power << 8) + (int32_t)get_state16(REG_CHn_REG_KP_w + offset) * error + integral;
+
+   // Limit rate of change, then absolute range
+   bool saturated = false;
+   if (drive > r->drive + slew) {
+      drive = r->drive + slew;
+      saturated = true;
+   } else if (drive < r->drive - slew) {
+      drive = r->drive - slew;
+      saturated = true;
+   }
+   if (drive > drive_max) {
+      drive = drive_max;
+      saturated = true;
+   } else if (drive < 0) {
+      drive = 0;
+      saturated = true;
+   }
+
+   // Conditional integration: freeze the integrator while the output is limited, preventing windup
+   if (saturated) {
+      const uint16_t address = REG_CHn_REG_SAT_COUNT_w + (ch_index * 2);
+      set_state16(address, get_state16(address) + 1);
+   } else {
+      r->integral = integral;
+   }
+
+   set_state16(REG_CHn_REG_ERROR_w + (ch_index * 2), (uint16_t)(int16_t)error);
+
+   r->drive = drive;
+}
+
+// Run the channel open-loop at the requested power, with the integrator cleared for a bumpless start once sense can be sampled
+static void hold_channel(uint8_t ch_index) {
+   regulator_t* r = &regulators[ch_index];
+   r->integral = 0;
+   r->drive = r->power << 8;
+   set_state16(REG_CHn_REG_ERROR_w + (ch_index * 2), 0);
+}
+
+// Returns true if the channel gates have been on for CH_REG_SETTLE_US and stay on until the sense driver has sampled the input.
+// Sets idle if the last pulse started more than CH_REG_SYNC_TIMEOUT_US ago.
+static bool gate_window_open(uint8_t ch_index, uint32_t time, bool* idle) {
+   uint32_t start_us, length_us;
+   if (!read_gate_window(ch_index, &start_us, &length_us))
+      return false;
+
+   const uint32_t elapsed = time - start_us;
+   *idle = elapsed > CH_REG_SYNC_TIMEOUT_US;
+   return elapsed >= CH_REG_SETTLE_US && elapsed + channels[ch_index].adc->sample_time_us <= length_us;
+}
+
+// Publish a completed sense reading, then update the loop of a regulated channel. Only readings taken inside a pulse are used by
+// the loop, otherwise the channel is held open-loop.
+static void sense_complete(uint8_t ch_index, bool ok, uint16_t counts) {
+   const uint8_t bit = 1 << ch_index;
+   if (ok) {
+      sense_counts[ch_index] = counts;
+      set_state16(REG_CHn_SENSE_w + (ch_index * 2), counts);
+   }
+
+   if (!(reg_round.regulated & bit))
+      return;
+
+   if (ok && (reg_round.synced & bit)) {
+      regulate_channel(ch_index, counts);
+      reg_round.closed |= bit;
+   } else {
+      hold_channel(ch_index); // sense read failed, or the channel isn't pulsing
+   }
+   reg_round.updated |= bit;
+}
+
+// Closed-loop constant current regulation. Fixed-point PI controller using the sense feedback, with the requested power as the feed forward term.
+// Sense is sampled every round on every ready channel, so REG_CHn_SENSE_w (and sense thresholds) update whether or not the channel is regulated.
+// Calibration measures sense with the gates on, so sense is sampled inside a pulse (gate synchronous) while the channel is pulsing.
+// Regulated channels that aren't pulsing, or whose pulses are too short for the sense driver to sample within, are held open-loop at
+// the requested power. Sense conversions are started and collected across calls when the driver supports it, so queued power
+// commands aren't blocked. Returns the channels which need their level set, once a regulation round is complete.
+static uint8_t regulate_power() {
+   if (reg_round.converting >= 0) { // collect async conversion result
+      const uint8_t ch_index = reg_round.converting;
+      const sense_driver_t* adc = channels[ch_index].adc;
+
+      uint16_t counts;
+      bool ok;
+      if (!adc->read_complete(adc, &counts, &ok))
+         return 0; // still converting
+
+      reg_round.converting = -1;
+      sense_complete(ch_index, ok, counts);
+   } else if (!reg_round.pending) { // start a new round
+      const uint32_t time = time_us_32();
+      if (time - reg_round.start_time_us < CH_REG_PERIOD_US)
+         return 0;
+      reg_round.start_time_us = time;
+      reg_round.regulated = 0;
+      reg_round.synced = 0;
+
+      const uint8_t enabled = get_state(REG_CH_REG_ENABLE);
+      for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
+         const bool ready = get_state(REG_CHn_STATUS + ch_index) == CHANNEL_READY;
+         if (ready)
+            reg_round.pending |= 1 << ch_index;
+
+         if (ready && (enabled & (1 << ch_index)) && get_state16(REG_CHn_REG_FULL_SCALE_w + (CH_REG_SIZE * ch_index)) != 0) {
+            reg_round.regulated |= 1 << ch_index;
+         } else {
+            hold_channel(ch_index); // open-loop, drop any loop correction and keep integrator clear for a bumpless enable
+            reg_round.updated |= 1 << ch_index;
+         }
+      }
+   }
+
+   // Sample the next channel that is inside a pulse, or isn't pulsing
+   const uint32_t time = time_us_32();
+   const bool timed_out = time - reg_round.start_time_us > CH_REG_SYNC_TIMEOUT_US;
+   for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT && reg_round.pending && reg_round.converting < 0; ch_index++) {
+      if (!(reg_round.pending & (1 << ch_index)))
+         continue;
+
+      bool idle = false;
+      if (gate_window_open(ch_index, time, &idle))
+         reg_round.synced |= 1 << ch_index;
+      else if (!idle && !timed_out)
+         continue; // wait for a pulse long enough to sample
+      reg_round.pending &= ~(1 << ch_index);
+
+      const channel_def_t* ch = &channels[ch_index];
+      if (sense_is_async(ch->adc)) {
+         if (ch->adc->read_start(ch->adc, ch->adc_channel)) {
+            reg_round.converting = ch_index;
+            continue;
+         }
+         sense_complete(ch_index, false, 0);
+      } else {
+         uint16_t counts;
+         const bool ok = ch->adc->read(ch->adc, ch->adc_channel, &counts);
+         sense_complete(ch_index, ok, counts);
+      }
+   }
+
+   if (reg_round.pending || reg_round.converting >= 0)
+      return 0;
+
+   // Round complete
+   set_state(REG_CH_REG_CLOSED, reg_round.closed);
+   reg_round.closed = 0;
+
+   const uint8_t updated = reg_round.updated;
+   reg_round.updated = 0;
+   return updated;
+}
+
+uint16_t output_sense(uint8_t ch_index) {
+   return ch_index < CHANNEL_COUNT ? sense_counts[ch_index] : 0;
 }
 
 bool output_pulse(uint8_t ch_index, uint16_t pos_us, uint16_t neg_us, uint32_t abs_time_us) {
@@ -385,6 +771,10 @@ bool output_pulse(uint8_t ch_index, uint16_t pos_us, uint16_t neg_us, uint32_t a
    return queue_try_add(&pulse_queue, &pulse);
 }
 
+uint8_t output_pulse_queue_level() {
+   return queue_get_level(&pulse_queue) + !fetch_pulse; // include the pulse waiting for its time
+}
+
 void output_set_power(uint8_t ch_index, uint16_t power) {
    if (ch_index >= CHANNEL_COUNT)
       return;
@@ -427,11 +817,12 @@ static int cmpfunc(const void* a, const void* b) {
 
 static float read_voltage(const channel_def_t* ch) {
 #ifdef USE_ADC_MEAN
+   uint8_t adc_channels[ADC_MEAN];
    uint16_t readings[ADC_MEAN];
 
    // Read n samples
-   for (uint8_t index = 0; index < ADC_MEAN; index++)
-      adc_read_counts(ch->adc_channel, &readings[index]);
+   memset(adc_channels, ch->adc_channel, ADC_MEAN);
+   sense_read_batch(ch->adc, adc_channels, readings, ADC_MEAN);
 
    // Ignore n highest and lowest values. Average the rest
    uint32_t total = 0;
@@ -441,8 +832,8 @@ static float read_voltage(const channel_def_t* ch) {
 
    uint16_t counts = total / (ADC_MEAN - (ADC_MEAN_TRIM_AMOUNT * 2));
 #else
-   uint16_t counts;
-   adc_read_counts(ch->adc_channel, &counts);
+   uint16_t counts = 0;
+   ch->adc->read(ch->adc, ch->adc_channel, &counts);
 #endif
-   return adc_compute_volts(counts);
+   return ch->adc->compute_volts(ch->adc, counts);
 }
\ No newline at end of file
@@ -38,8 +38,14 @@ void output_process_pulses();
 void output_process_power();
 
 bool output_pulse(uint8_t index, uint16_t pos_us, uint16_t neg_us, uint32_t abs_time_us);
+
+// Returns the number of pulses waiting to be output
+uint8_t output_pulse_queue_level();
 void output_set_power(uint8_t index, uint16_t power);
 
+// Returns the latest sense reading of the channel in counts (see REG_CHn_SENSE_w). Safe to call from core0.
+uint16_t output_sense(uint8_t index);
+
 void set_psu_enabled(bool enabled);
 bool is_psu_enabled();
 
@@ -20,6 +20,10 @@
 
 #include "output.h"
 #include "pulse_gen.h"
+#include "analog_capture.h"
+#include "trigger.h"
+#include "timers.h"
+#include "action.h"
 
 #include <pico/i2c_slave.h>
 
@@ -53,7 +57,9 @@ static void __not_in_flash_func(i2c_slave_handler)(i2c_inst_t* i2c, i2c_slave_ev
          } else {
             // save into memory
             const uint8_t value = i2c_read_byte_raw(i2c);
-            if (ctx.address >= READ_ONLY_ADDRESS_BOUNDARY) {
+            if (ctx.address == REG_PCM_DATA) {
+               analog_capture_pcm_write(value); // stream into the PCM upload ring, address doesn't advance
+            } else if (ctx.address >= READ_ONLY_ADDRESS_BOUNDARY && ctx.address < STATUS_ADDRESS_BOUNDARY) {
                mem[ctx.address] = value;
                CHECK_BOUNDS(ctx.address++);
             }
@@ -65,6 +71,8 @@ static void __not_in_flash_func(i2c_slave_handler)(i2c_inst_t* i2c, i2c_slave_ev
          CHECK_BOUNDS(ctx.address++);
          break;
       case I2C_SLAVE_FINISH: // master has signalled Stop / Restart
+         if (ctx.ready == 2 && ctx.address == REG_PCM_DATA)
+            analog_capture_pcm_end_write();
          ctx.ready = 0;
          dirty = true;
          break;
@@ -104,6 +112,18 @@ void protocol_process() {
    // update hardware PSU state
    set_psu_enabled(get_state(REG_PSU_ENABLE));
 
+   // update analog capture config
+   const uint8_t capture_sources = get_state(REG_CAPTURE_SRC);
+   const bool low_latency = get_state(REG_AUDIO_LOW_LATENCY);
+   analog_capture_configure(capture_sources, get_state16(REG_CAPTURE_RATE_w), get_state16(REG_CAPTURE_LENGTH_w), low_latency);
+   analog_capture_configure_i2s(capture_sources, get_state16(REG_I2S_RATE_w), get_state16(REG_I2S_LENGTH_w), get_state(REG_I2S_BITS), low_latency);
+   analog_capture_configure_pcm(capture_sources, get_state16(REG_PCM_RATE_w), get_state16(REG_PCM_LENGTH_w), low_latency);
+
+   // recompile changed actions and trigger config, and start or stop timers
+   actions_configure();
+   triggers_configure();
+   timers_configure();
+
    // run requested cmd
    const uint8_t state = get_state(REG_CMD);
    if (state) {
@@ -16,11 +16,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "pulse_gen.h"
+#include "action.h"
 #include "output.h"
+#include "audio.h"
+#include "sequencer.h"
 #include "parameter.h"
 #include "state.h"
 
 #include "util/gpio.h"
+#include "util/curve.h"
 
 #define STATE_COUNT (4)
 
@@ -34,16 +38,15 @@ static const param_t STATE_SEQUENCE[STATE_COUNT] = {
 
 static channel_data_t channels[CHANNEL_COUNT];
 
-static uint32_t sequencer_time_us; // next sequencer state change time in microseconds
-
-extern void audio_process(channel_data_t* ch, uint8_t ch_index, uint16_t power);
+// Offset of a keyframe entry from the REG_KFn_... registers
+#define KEYFRAME_OFFSET(ch_index, index) (KEYFRAME_SIZE * ((ch_index)*MAX_KEYFRAMES + (index)))
 
 static inline void parameter_step(uint8_t ch_index, param_t param);
 
 void pulse_gen_init() {
    LOG_DEBUG("Init pulse generator...\n");
 
-   sequencer_time_us = 0;
+   sequencers_init();
 
    // Set default parameter values
    for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
@@ -63,35 +66,13 @@ void pulse_gen_init() {
       SET_VALUE(ch_index, PARAM_OFF_TIME, TARGET_MAX, 10000);     // 10 seconds
       SET_VALUE(ch_index, PARAM_OFF_RAMP_TIME, TARGET_MAX, 5000); // 5 seconds
    }
+
+   audio_init();
 }
 
 void pulse_gen_process() {
-   // update sequencer and active sequence mask
-   const uint16_t seq_period_ms = get_state16(REG_SEQ_PERIOD);
-   const uint8_t seq_count = get_state(REG_SEQ_COUNT);
-
-   uint8_t sequencer_mask;
-   if (seq_period_ms == 0 || seq_count == 0) {
-      sequencer_mask = 0xff; // if sequencer is disabled, make mask all enabled
-   } else {
-
-      uint8_t sequencer_index = get_state(REG_SEQ_INDEX);
-      if (sequencer_index >= MAX_SEQ_COUNT)
-         sequencer_index = MAX_SEQ_COUNT - 1;
-
-      uint32_t time = time_us_32();
-      if (time > sequencer_time_us) {
-         if (++sequencer_index >= seq_count || sequencer_index >= MAX_SEQ_COUNT)
-            sequencer_index = 0; // Increment or reset after REG_SEQ_COUNT
-
-         set_state(REG_SEQ_INDEX, sequencer_index);
-
-         // Set the next sequencer time based on the REG_SEQ_PERIOD
-         sequencer_time_us = time + (seq_period_ms * 1000);
-      }
-
-      sequencer_mask = get_state(REG_SEQn + sequencer_index);
-   }
+   // update sequencers and active sequence mask
+   const uint8_t sequencer_mask = sequencers_process();
 
    // currently enabled channel mask based on REG_CH_GEN_ENABLE and current sequencer slot item
    const uint8_t en = get_state(REG_CH_GEN_ENABLE) & sequencer_mask;
@@ -118,26 +99,33 @@ void pulse_gen_process() {
          ch->next_state_time_us = time + (GET_VALUE(ch_index, STATE_SEQUENCE[ch->state_index], TARGET_VALUE) * 1000);
       }
 
-      // TODO: Replace with fixed point ?
-      float power_modifier = 1.0f;
+      uint32_t state_q15 = CURVE_ONE; // Q15 power modifier for the current state
       // Scale power level depending on the current state (e.g. transition between off and on)
       time = time_us_32();
       param_t channel_state = STATE_SEQUENCE[ch->state_index];
       switch (channel_state) {
          case PARAM_ON_RAMP_TIME:    // Ramp power from zero to power value
          case PARAM_OFF_RAMP_TIME: { // Ramp power from power value to zero
-            uint16_t ramp_time = GET_VALUE(ch_index, channel_state, TARGET_VALUE) * 1000;
+            uint32_t ramp_time = GET_VALUE(ch_index, channel_state, TARGET_VALUE) * 1000;
             if (ramp_time == 0)
                break;
 
             uint32_t time_remaining = ch->next_state_time_us - time;
+            if (time_remaining > ramp_time)
+               time_remaining = ramp_time;
+
+            // Scale down long ramps so the Q15 shifted elapsed time fits in 32 bits
+            uint32_t elapsed = ramp_time - time_remaining;
+            while (ramp_time >= (1 << 17)) {
+               ramp_time >>= 1;
+               elapsed >>= 1;
+            }
 
-            power_modifier = (float)time_remaining / ramp_time;
-            if (power_modifier > 1)
-               power_modifier = 1;
+            uint16_t phase = (elapsed << 15) / ramp_time; // Q15
+            if (channel_state == PARAM_OFF_RAMP_TIME)
+               phase = CURVE_ONE - phase; // Run the curve backwards if transition is going from on to off
 
-            if (channel_state == PARAM_ON_RAMP_TIME)
-               power_modifier = 1.0f - power_modifier; // Invert percentage if transition is going from off to on
+            state_q15 = curve_lookup(get_state(REG_CHn_RAMP_CURVE + ch_index), phase);
             break;
          }
 
@@ -147,17 +135,16 @@ void pulse_gen_process() {
             break;
       }
 
-      // Combine the channel power modifier with the 'state' power modifier
-      const uint16_t power_level = get_state16(REG_CHn_POWER_w + (ch_index * 2));
-      power_modifier *= ((float)(power_level < CHANNEL_POWER_MAX ? power_level : CHANNEL_POWER_MAX) / CHANNEL_POWER_MAX);
-
       uint16_t power = GET_VALUE(ch_index, PARAM_POWER, TARGET_VALUE);
       if (power == 0)
          continue;
       if (power > CHANNEL_POWER_MAX)
          power = CHANNEL_POWER_MAX;
 
-      power = (uint16_t)(power_modifier * (float)power);
+      // Combine the channel power level with the 'state' power modifier
+      const uint16_t power_level = get_state16(REG_CHn_POWER_w + (ch_index * 2));
+      power = (power * state_q15) >> 15;
+      power = (power * (uint32_t)(power_level < CHANNEL_POWER_MAX ? power_level : CHANNEL_POWER_MAX)) / CHANNEL_POWER_MAX;
 
       // Channel has audio source, so process audio instead of processing function gen
       if (get_state(REG_CHn_AUDIO_SRC + ch_index) != 0) {
@@ -172,133 +159,118 @@ void pulse_gen_process() {
          }
 
          // Generate the pulses
-         time = time_us_32();
-         if (time > ch->next_pulse_time_us) {
-            const uint16_t frequency = GET_VALUE(ch_index, PARAM_FREQUENCY, TARGET_VALUE);
-            const uint16_t pulse_width = GET_VALUE(ch_index, PARAM_PULSE_WIDTH, TARGET_VALUE);
+         pulse_gen_pulse(ch, ch_index);
+      }
+   }
+}
 
-            if (frequency == 0 || pulse_width == 0)
-               continue;
+void pulse_gen_pulse(channel_data_t* ch, uint8_t ch_index) {
+   const uint32_t time = time_us_32();
+   if (time > ch->next_pulse_time_us) {
+      const uint16_t frequency = GET_VALUE(ch_index, PARAM_FREQUENCY, TARGET_VALUE);
+      const uint16_t pulse_width = GET_VALUE(ch_index, PARAM_PULSE_WIDTH, TARGET_VALUE);
 
-            ch->next_pulse_time_us = time + (10000000ul / frequency); // dHz -> us
+      if (frequency == 0 || pulse_width == 0)
+         return;
 
-            // Pulse the channel
-            output_pulse(ch_index, pulse_width, pulse_width, time_us_32());
-         }
-      }
+      ch->next_pulse_time_us = time + (10000000ul / frequency); // dHz -> us
+
+      // Pulse the channel
+      output_pulse(ch_index, pulse_width, pulse_width, time_us_32());
    }
 }
 
-// alarm callback function for disabling channel pulse generation using a channel mask
-static int64_t ch_gen_mask_disable_cb(alarm_id_t id, void* user_data) {
-   (void) id;
-   const uint8_t channel_mask = (int)user_data;
-   set_state(REG_CH_GEN_ENABLE, get_state(REG_CH_GEN_ENABLE) & ~channel_mask);
-   return 0; // dont reschedule the alarm
-}
+// Parameter value extent reached, run action list if specified and notify if the notify bit is set in the mode
+static inline void parameter_extent_reached(uint8_t ch_index, param_t param, uint16_t mode_raw) {
+   const uint16_t al = GET_VALUE(ch_index, param, TARGET_ACTION_RANGE);
+   execute_action_list(al >> 8, al & 0xff); // start:upper byte, end: lower byte
 
-// alarm callback function for enabling channel pulse generation using a channel mask
-static int64_t ch_gen_mask_enable_cb(alarm_id_t id, void* user_data) {
-   (void) id;   
-   const uint8_t channel_mask = (int)user_data;
-   set_state(REG_CH_GEN_ENABLE, get_state(REG_CH_GEN_ENABLE) | channel_mask);
-   return 0; // dont reschedule the alarm
+   // if the notify bit is set, update flags and assert notify pin
+   if (mode_raw & TARGET_MODE_NOTIFY_BIT) {
+      const uint16_t address = REG_CHn_PARAM_FLAGS_w + (ch_index * 2);
+      set_state16(address, get_state16(address) | (1 << param));
+      gpio_assert(PIN_INT);
+   }
 }
 
-// alarm callback function for toggling channel pulse generation using a channel mask
-static int64_t ch_gen_mask_toggle_cb(alarm_id_t id, void* user_data) {
-   (void) id;
-   const uint8_t channel_mask = (int)user_data;
-   set_state(REG_CH_GEN_ENABLE, get_state(REG_CH_GEN_ENABLE) ^ channel_mask);
-   return 0; // dont reschedule the alarm
+// Returns the curve shaped fraction (Q15) of a linear fraction (Q15, 0 to 32768)
+static inline uint32_t keyframe_curve(keyframe_curve_t curve, uint32_t f) {
+   switch (curve) {
+      case KEYFRAME_CURVE_HOLD:
+         return 0;
+      case KEYFRAME_CURVE_EASE_IN:
+         return (f * f) >> 15;
+      case KEYFRAME_CURVE_EASE_OUT: {
+         const uint32_t r = 32768 - f;
+         return 32768 - ((r * r) >> 15);
+      }
+      case KEYFRAME_CURVE_SMOOTH: // 3f^2 - 2f^3
+         return (((f * f) >> 15) * (3 * 32768 - 2 * f)) >> 15;
+      case KEYFRAME_CURVE_LINEAR:
+      default:
+         return f;
+   }
 }
 
-// execute the action at the given action slot index
-static inline void execute_action(uint8_t a_index) {
-   if (a_index >= MAX_ACTIONS)
+// Update the parameter value from its keyframes, using the time since the keyframes started. The cursor only moves
+// forward, so each update compares against the next keyframe time instead of searching the whole range.
+static inline void keyframe_step(uint8_t ch_index, param_t param, uint16_t mode_raw) {
+   parameter_data_t* p = &channels[ch_index].parameters[param];
+
+   const uint32_t time = time_us_32();
+   if (time < p->next_update_time_us) // only update at required time
       return;
 
-   const uint16_t offset = ACTION_SIZE * a_index;
+   p->next_update_time_us = time + KEYFRAME_UPDATE_PERIOD_US;
 
-   const action_type_t type = get_state(REG_An_TYPE + offset);
-   if (type == ACTION_NONE)
+   const uint16_t range = get_state16(REG_CHn_PARAMn_KEYFRAMES_w + (ch_index * TOTAL_PARAMS + param) * 2);
+   const uint8_t start = range >> 8; // start:upper byte, end: lower byte
+   const uint8_t end = MIN(range & 0xff, MAX_KEYFRAMES);
+   if (start >= end)
       return;
 
-   const uint8_t channel_mask = get_state(REG_An_CHANNEL_MASK + offset);
-   const uint16_t value = get_state16(REG_An_VALUE_w + offset);
+   const uint16_t duration_ms = get_state16(REG_KFn_TIME_w + KEYFRAME_OFFSET(ch_index, end - 1));
+   uint32_t elapsed_ms = (time - p->keyframe_start_us) / 1000;
 
-   switch (type) {
-      case ACTION_SET:
-      case ACTION_INCREMENT:
-      case ACTION_DECREMENT: { // set,increment,decrement param+target value for all channels in mask, while keeping it constrained to TARGET_MIN/MAX
-         const uint8_t param_target = get_state(REG_An_PARAM_TARGET + offset);
-         const param_t param = param_target >> 8;
-         const target_t target = param_target & 0xff;
-
-         if (param >= TOTAL_PARAMS || target >= TOTAL_TARGETS)
-            return;
+   const bool end_reached = elapsed_ms >= duration_ms;
+   if (end_reached) {
+      if ((mode_raw & ~TARGET_MODE_NOTIFY_BIT) == TARGET_MODE_KEYFRAMES_LOOP && duration_ms != 0) {
+         // Restart from the first keyframe, skipping whole loops that were missed
+         const uint32_t loops = elapsed_ms / duration_ms;
+         p->keyframe_start_us += loops * duration_ms * 1000;
+         elapsed_ms -= loops * duration_ms;
+         p->keyframe = start;
+      } else { // Hold the last keyframe value and disable cycling, clearing the notify bit
+         elapsed_ms = duration_ms;
+         SET_VALUE(ch_index, param, TARGET_MODE, TARGET_MODE_DISABLED);
+      }
+   }
 
-         uint16_t val = value;
-         for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
-            if (~channel_mask & (1 << ch_index))
-               continue;
+   if (p->keyframe < start || p->keyframe >= end)
+      p->keyframe = start;
 
-            if (type == ACTION_INCREMENT) {
-               val = GET_VALUE(ch_index, param, target) + value;
-            } else if (type == ACTION_DECREMENT) {
-               val = GET_VALUE(ch_index, param, target) - value;
-            }
+   // Advance the cursor to the segment containing the elapsed time
+   while (p->keyframe + 1 < end && elapsed_ms >= get_state16(REG_KFn_TIME_w + KEYFRAME_OFFSET(ch_index, p->keyframe + 1)))
+      p->keyframe++;
 
-            if (target == TARGET_VALUE) { // limit target value between TARGET_MIN and TARGET_MAX
-               const uint16_t min = GET_VALUE(ch_index, param, TARGET_MIN);
-               const uint16_t max = GET_VALUE(ch_index, param, TARGET_MAX);
+   const uint16_t offset = KEYFRAME_OFFSET(ch_index, p->keyframe);
+   const uint16_t t0 = get_state16(REG_KFn_TIME_w + offset);
+   uint16_t value = get_state16(REG_KFn_VALUE_w + offset);
 
-               if (val > max) {
-                  val = max;
-               } else if (val < min) {
-                  val = min;
-               }
-            }
+   // Interpolate towards the next keyframe, before the first keyframe time the value holds at the first keyframe
+   if (p->keyframe + 1 < end && elapsed_ms > t0) {
+      const uint16_t next_offset = KEYFRAME_OFFSET(ch_index, p->keyframe + 1);
+      const uint16_t t1 = get_state16(REG_KFn_TIME_w + next_offset);
+      const int32_t delta = get_state16(REG_KFn_VALUE_w + next_offset) - value;
 
-            SET_VALUE(ch_index, param, target, val);
-         }
-         break;
-      }
-      case ACTION_ENABLE: // enable channel generation for mask, with optional delayed disable in milliseconds
-         set_state(REG_CH_GEN_ENABLE, get_state(REG_CH_GEN_ENABLE) | channel_mask);
-         if (value > 0 && channel_mask) // add_alarm_in_ms doesn't copy user_data, so use user_data as the value instead of a pointer
-            add_alarm_in_ms(value, ch_gen_mask_disable_cb, (void*)((int)channel_mask), true);
-         break;
-      case ACTION_DISABLE: // disable channel generation for mask, with optional delayed enable in milliseconds
-         set_state(REG_CH_GEN_ENABLE, get_state(REG_CH_GEN_ENABLE) & ~channel_mask);
-         if (value > 0 && channel_mask) // add_alarm_in_ms doesn't copy user_data, so use user_data as the value instead of a pointer
-            add_alarm_in_ms(value, ch_gen_mask_enable_cb, (void*)((int)channel_mask), true);
-         break;
-      case ACTION_TOGGLE: // toggle channel generation for mask, with optional delayed toggle in milliseconds
-         set_state(REG_CH_GEN_ENABLE, get_state(REG_CH_GEN_ENABLE) ^ channel_mask);
-         if (value > 0 && channel_mask) // add_alarm_in_ms doesn't copy user_data, so use user_data as the value instead of a pointer
-            add_alarm_in_ms(value, ch_gen_mask_toggle_cb, (void*)((int)channel_mask), true);
-         break;
-      case ACTION_EXECUTE:                              // run another action list from this list
-         execute_action_list(value >> 8, value & 0xff); // start:upper byte, end: lower byte
-         break;
-      case ACTION_PARAM_UPDATE: { // update parameter step/rate using channel mask
-         const uint8_t param_target = get_state(REG_An_PARAM_TARGET + offset);
-         const param_t param = param_target >> 8;
-         for (uint8_t ch_index = 0; ch_index < CHANNEL_COUNT; ch_index++) {
-            if (channel_mask & (1 << ch_index))
-               parameter_update(ch_index, param);
-         }
-         break;
-      }
-      default:
-         break;
+      const uint32_t f = ((elapsed_ms - t0) << 15) / (t1 - t0); // Q15, t1 > elapsed_ms > t0
+      value += (delta * (int32_t)keyframe_curve(get_state(REG_KFn_CURVE + offset), f)) >> 15;
    }
-}
 
-void execute_action_list(uint8_t al_start, uint8_t al_end) {
-   for (uint8_t i = al_start; i < al_end; i++)
-      execute_action(i);
+   SET_VALUE(ch_index, param, TARGET_VALUE, value); // Update value
+
+   if (end_reached)
+      parameter_extent_reached(ch_index, param, mode_raw);
 }
 
 // Update the parameter value by stepping based on the current parameter mode and step rate.
@@ -310,6 +282,11 @@ static inline void parameter_step(uint8_t ch_index, param_t param) {
    const uint16_t mode_raw = GET_VALUE(ch_index, param, TARGET_MODE);
    const uint16_t mode = mode_raw & ~TARGET_MODE_NOTIFY_BIT;
 
+   if (mode == TARGET_MODE_KEYFRAMES || mode == TARGET_MODE_KEYFRAMES_LOOP) {
+      keyframe_step(ch_index, param, mode_raw);
+      return;
+   }
+
    // Skip update if parameter is static
    if (mode == TARGET_MODE_DISABLED || GET_VALUE(ch_index, param, TARGET_RATE) == 0 || p->step == 0)
       return;
@@ -356,18 +333,8 @@ static inline void parameter_step(uint8_t ch_index, param_t param) {
 
    SET_VALUE(ch_index, param, TARGET_VALUE, value); // Update value
 
-   if (end_reached) {
-      // parameter value extent reached, run action list if specified
-      const uint16_t al = GET_VALUE(ch_index, param, TARGET_ACTION_RANGE);
-      execute_action_list(al >> 8, al & 0xff); // start:upper byte, end: lower byte
-
-      // if the notify bit is set, update flags and assert notify pin
-      if (mode_raw & TARGET_MODE_NOTIFY_BIT) {
-         const uint16_t address = REG_CHn_PARAM_FLAGS_w + (ch_index * 2);
-         set_state16(address, get_state16(address) | (1 << param));
-         gpio_assert(PIN_INT);
-      }
-   }
+   if (end_reached)
+      parameter_extent_reached(ch_index, param, mode_raw);
 }
 
 void parameter_update(uint8_t ch_index, param_t param) {
@@ -377,6 +344,15 @@ void parameter_update(uint8_t ch_index, param_t param) {
    // Get the mode without the notify bit
    const uint16_t mode = GET_VALUE(ch_index, param, TARGET_MODE) & ~TARGET_MODE_NOTIFY_BIT;
 
+   // Restart keyframes from the first keyframe
+   if (mode == TARGET_MODE_KEYFRAMES || mode == TARGET_MODE_KEYFRAMES_LOOP) {
+      parameter_data_t* p = &channels[ch_index].parameters[param];
+      p->keyframe_start_us = time_us_32();
+      p->next_update_time_us = p->keyframe_start_us;
+      p->keyframe = 0;
+      return;
+   }
+
    // Determine steps and update period based on cycle rate
    const uint16_t rate = GET_VALUE(ch_index, param, TARGET_RATE);
    if (mode != TARGET_MODE_DISABLED && rate != 0) {
@@ -28,11 +28,18 @@
 // Sets the uint16 parameter target value for the given channel. See param_t and target_t.
 #define SET_VALUE(ch_index, param, target, value) set_state16(REG_CHn_PARAM_w + PARAM_TARGET_INDEX((ch_index), (param), (target)), (value))
 
+#ifndef KEYFRAME_UPDATE_PERIOD_US
+#define KEYFRAME_UPDATE_PERIOD_US (1000) // time between keyframe automation updates in microseconds
+#endif
+
 typedef struct {
    int8_t step; // number of steps to increment/decrement per parameter update
 
    uint32_t next_update_time_us; // the next parameter step time in microseconds
    uint32_t update_period_us;    // parameter step update period in microseconds
+
+   uint8_t keyframe;           // keyframe automation cursor, the keyframe the current segment starts at
+   uint32_t keyframe_start_us; // time the keyframes started (or last looped) in microseconds
 } parameter_data_t;
 
 typedef struct {
@@ -53,12 +60,12 @@ void pulse_gen_init();
 // pulses manually or via audio processing depending on configured source.
 void pulse_gen_process();
 
+// Pulse the channel if the next pulse time has passed, using the channel frequency and pulse width parameters.
+void pulse_gen_pulse(channel_data_t* ch, uint8_t ch_index);
+
 // Updates the parameter step period and step size based on the current target mode, minmum, maximum, and rate.
 // Should be called whenever TARGET_MODE, TARGET_MIN, TARGET_MAX, or TARGET_RATE is changed, and the parameter is
-// sweeping the value.
+// sweeping the value. Restarts keyframe automation if the parameter is following keyframes.
 void parameter_update(uint8_t ch_index, param_t param);
 
-// execute each action between indices al_start and al_end
-void execute_action_list(uint8_t al_start, uint8_t al_end);
-
 #endif // _PULSE_GEN_H
\ No newline at end of file
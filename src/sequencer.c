@@ -0,0 +1,120 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "sequencer.h"
+
+#include "message.h"
+#include "state.h"
+#include "action.h"
+
+#define GLOBAL_SEQUENCER (MAX_SEQUENCERS) // index of the global sequencer state, after the independent sequencers
+
+typedef struct {
+   bool running;
+   uint8_t index;         // current slot, relative to the first slot
+   uint64_t next_time_us; // time the current slot ends
+} sequencer_state_t;
+
+static sequencer_state_t sequencers[MAX_SEQUENCERS + 1];
+
+void sequencers_init() {
+   for (uint8_t index = 0; index <= MAX_SEQUENCERS; index++)
+      sequencers[index].running = false;
+}
+
+// Returns the slot duration in microseconds, 0 if the slot has no duration
+static inline uint32_t slot_duration_us(uint8_t slot) {
+   uint16_t duration_ms = get_state16(REG_SEQn_DURATION_w + slot * 2);
+   if (duration_ms == 0)
+      duration_ms = get_state16(REG_SEQ_PERIOD);
+   return duration_ms * 1000ul;
+}
+
+// Returns the channel mask of the sequencer's current slot, entering the next slot when the current one has ended.
+// Slots end on a fixed schedule from when the sequencer started, so non-uniform rhythms don't drift.
+static uint8_t sequencer_update(sequencer_state_t* seq, uint8_t start, uint8_t count, uint16_t index_address, uint64_t now) {
+   if (start >= MAX_SEQ_COUNT)
+      count = 0;
+   else
+      count = MIN(count, MAX_SEQ_COUNT - start);
+
+   if (count == 0) {
+      seq->running = false;
+      return 0xff; // if sequencer is disabled, make mask all enabled
+   }
+
+   uint8_t index = get_state(index_address);
+   if (index >= count)
+      index = count - 1;
+
+   uint64_t slot_start;
+   if (!seq->running || index != seq->index) { // started, or the index register was written
+      slot_start = now;
+   } else if (now >= seq->next_time_us) {
+      if (++index >= count)
+         index = 0; // Increment or reset after slot count
+
+      // Stay on the schedule, unless a whole slot was missed (e.g. the sequencer was held by a zero duration)
+      slot_start = seq->next_time_us;
+      if (now - slot_start >= slot_duration_us(start + index))
+         slot_start = now;
+   } else {
+      return get_state(REG_SEQn + start + index);
+   }
+
+   const uint8_t slot = start + index;
+   const uint32_t duration_us = slot_duration_us(slot);
+
+   seq->index = index;
+   set_state(index_address, index);
+
+   if (duration_us == 0) { // hold the sequencer disabled until the slot has a duration
+      seq->running = false;
+      return 0xff;
+   }
+
+   seq->running = true;
+   seq->next_time_us = slot_start + duration_us;
+
+   const uint16_t al = get_state16(REG_SEQn_ACTION_w + slot * 2);
+   execute_action_list(al >> 8, al & 0xff); // start:upper byte, end: lower byte
+
+   return get_state(REG_SEQn + slot);
+}
+
+uint8_t sequencers_process() {
+   const uint64_t now = time_us_64();
+
+   uint8_t mask = sequencer_update(&sequencers[GLOBAL_SEQUENCER], 0, get_state(REG_SEQ_COUNT), REG_SEQ_INDEX, now);
+
+   // Independent sequencers override the global sequencer for their channels
+   for (uint8_t index = 0; index < MAX_SEQUENCERS; index++) {
+      const uint16_t offset = SEQUENCER_SIZE * index;
+
+      const uint8_t channel_mask = get_state(REG_SEQUENCERn_CHANNEL_MASK + offset);
+      if (channel_mask == 0) {
+         sequencers[index].running = false;
+         continue;
+      }
+
+      const uint8_t slot_mask = sequencer_update(&sequencers[index], get_state(REG_SEQUENCERn_START + offset), get_state(REG_SEQUENCERn_COUNT + offset),
+                                                 REG_SEQUENCERn_INDEX + offset, now);
+      mask = (mask & ~channel_mask) | (slot_mask & channel_mask);
+   }
+
+   return mask;
+}
@@ -0,0 +1,29 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SEQUENCER_H
+#define _SEQUENCER_H
+
+#include "swx.h"
+
+void sequencers_init();
+
+// Step the global and independent sequencers, entering slots that are due and running their slot entry actions.
+// Returns the mask of channels enabled by the sequencers' current slots.
+uint8_t sequencers_process();
+
+#endif // _SEQUENCER_H
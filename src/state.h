@@ -38,6 +38,13 @@ static inline void set_state16(uint16_t address, uint16_t value) {
    mem[address + 1] = (value >> 8) & 0xFF;
 }
 
+// Set a 32-bit I2C accessible value at the current and next 3 addresses (least significant byte first). Bypasses readonly region
+// defined by READ_ONLY_ADDRESS_BOUNDARY. Value is accessible by the I2C master.
+static inline void set_state32(uint16_t address, uint32_t value) {
+   set_state16(address, value & 0xFFFF);
+   set_state16(address + 2, value >> 16);
+}
+
 // Returns the 8-bit I2C accessible value at the given address. Value is accessible by the I2C master.
 static inline uint8_t get_state(uint16_t address) {
    extern uint8_t mem[MAX_STATE_MEM_SIZE];
@@ -50,4 +57,9 @@ static inline uint16_t get_state16(uint16_t address) {
    return mem[address] | (mem[address + 1] << 8);
 }
 
+// Returns the 32-bit I2C accessible value by using the current and next 3 addresses. Value is accessible by the I2C master.
+static inline uint32_t get_state32(uint16_t address) {
+   return get_state16(address) | ((uint32_t)get_state16(address + 2) << 16);
+}
+
 #endif // _STATE_H
\ No newline at end of file
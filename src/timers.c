@@ -0,0 +1,89 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "timers.h"
+
+#include "message.h"
+#include "state.h"
+#include "action.h"
+
+typedef struct {
+   bool running;
+   uint64_t next_time_us; // time of the next firing
+   uint16_t count;        // firings since started
+} timer_state_t;
+
+static timer_state_t timers[MAX_TIMERS];
+
+void timers_init() {
+   for (uint8_t index = 0; index < MAX_TIMERS; index++) {
+      timers[index].running = false;
+      set_state(REG_TIMERn_ENABLE + TIMER_SIZE * index, 0);
+      set_state16(REG_TIMERn_COUNT_w + index * 2, 0);
+   }
+}
+
+void timers_configure() {
+   const uint64_t now = time_us_64();
+
+   for (uint8_t index = 0; index < MAX_TIMERS; index++) {
+      timer_state_t* timer = &timers[index];
+      const uint16_t offset = TIMER_SIZE * index;
+
+      const bool enabled = get_state(REG_TIMERn_ENABLE + offset);
+      if (enabled == timer->running)
+         continue;
+
+      timer->running = enabled;
+      if (!enabled)
+         continue;
+
+      timer->next_time_us = now + get_state32(REG_TIMERn_PHASE_dw + offset);
+      timer->count = 0;
+      set_state16(REG_TIMERn_COUNT_w + index * 2, 0);
+   }
+}
+
+void timers_process() {
+   const uint64_t now = time_us_64();
+
+   for (uint8_t index = 0; index < MAX_TIMERS; index++) {
+      timer_state_t* timer = &timers[index];
+      if (!timer->running || now < timer->next_time_us)
+         continue;
+
+      const uint16_t offset = TIMER_SIZE * index;
+      const uint32_t period_us = get_state32(REG_TIMERn_PERIOD_dw + offset);
+      const uint16_t repeat = get_state16(REG_TIMERn_REPEAT_w + offset);
+
+      timer->count++;
+      set_state16(REG_TIMERn_COUNT_w + index * 2, timer->count);
+
+      if (period_us == 0 || (repeat && timer->count >= repeat)) {
+         timer->running = false;
+         set_state(REG_TIMERn_ENABLE + offset, 0);
+      } else {
+         // Stay on the schedule, skipping firings that were missed (e.g. a long action list) instead of bunching them up.
+         // Skipped in one step, so a short period after a long stall doesn't loop once per missed firing.
+         timer->next_time_us += ((now - timer->next_time_us) / period_us + 1) * period_us;
+      }
+
+      const uint16_t action = get_state16(REG_TIMERn_ACTION_w + offset);
+      if (action)
+         execute_action_list(action >> 8, action & 0xff); // start:upper byte, end: lower byte
+   }
+}
@@ -0,0 +1,31 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _TIMERS_H
+#define _TIMERS_H
+
+#include "swx.h"
+
+void timers_init();
+
+// Start or stop timers when their enable register changes. Timers started by the same call share a start time.
+void timers_configure();
+
+// Run the action list of timers that are due
+void timers_process();
+
+#endif // _TIMERS_H
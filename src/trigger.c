@@ -18,124 +18,416 @@
 #include "trigger.h"
 
 #include <hardware/gpio.h>
+#include <string.h>
 
 #include "parameter.h"
+#include "channel.h"
 #include "message.h"
 #include "state.h"
-#include "pulse_gen.h"
+#include "action.h"
+#include "audio.h"
+#include "output.h"
+
+#ifndef TRIGGER_EDGE_FIFO_SIZE
+#define TRIGGER_EDGE_FIFO_SIZE (64) // edges buffered between updates, must be a power of 2
+#endif
+#define TRIGGER_EDGE_FIFO_MASK (TRIGGER_EDGE_FIFO_SIZE - 1)
+
+#define TRIGGER_DEFAULT_DEBOUNCE_US (2000)
+
+typedef struct {
+   uint32_t time_us; // time of the edge, taken in the GPIO IRQ
+   uint8_t input;    // trigger input index
+   bool level;       // input level after the edge
+} trigger_edge_t;
 
-#if TRIGGER_COUNT > 0
 static volatile bool triggers_dirty = false;
-static uint32_t next_update_time_us = 0;
 
-static bool previous_results[MAX_TRIGS] = {0};
+#define TRIGGER_STATES (16) // 4 trigger inputs
 
-void __not_in_flash_func(trigger_callback)(uint gpio, uint32_t events) {
-   triggers_dirty = true;
-}
-#endif
+static uint32_t previous_results = 0; // last result of each trigger (bit per trigger)
+
+// Compiled trigger entries, see triggers_configure()
+static uint32_t enabled_triggers = 0;             // bit per trigger
+static uint32_t virtual_triggers = 0;             // enabled triggers using audio onset inputs, evaluated individually
+static uint16_t tables[MAX_TRIGS];                // truth table of each trigger, indexed by the raw input state
+static uint32_t results_by_state[TRIGGER_STATES]; // trigger results for each input state (bit per trigger)
+static_assert(MAX_TRIGS <= 32); // Ensure triggers fit the result bit fields
+
+static uint8_t input_state = 0; // debounced trigger input levels (bit per input, LSB is input 1)
+
+static uint8_t threshold_state = 0; // analog threshold states (bit per threshold)
+static uint8_t threshold_rises = 0; // thresholds that went high since triggers were last evaluated
+static_assert(TOTAL_ANALOG_CHANNELS < TRIGGER_SOURCE_THRESHOLD); // Ensure audio sources and thresholds don't overlap
 
-void triggers_init() {
 #if TRIGGER_COUNT > 0
-   gpio_set_irq_enabled_with_callback(PIN_TRIGGER1, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &trigger_callback);
+static const uint8_t trigger_pins[] = {
+   PIN_TRIGGER1,
 #if TRIGGER_COUNT > 1
-   gpio_set_irq_enabled_with_callback(PIN_TRIGGER2, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &trigger_callback);
+   PIN_TRIGGER2,
 #if TRIGGER_COUNT > 2
-   gpio_set_irq_enabled_with_callback(PIN_TRIGGER3, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &trigger_callback);
+   PIN_TRIGGER3,
 #if TRIGGER_COUNT > 3
-   gpio_set_irq_enabled_with_callback(PIN_TRIGGER4, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &trigger_callback);
-#endif
+   PIN_TRIGGER4,
 #endif
 #endif
 #endif
-}
+};
 
-void triggers_process() {
-#if TRIGGER_COUNT > 0
+static trigger_edge_t edges[TRIGGER_EDGE_FIFO_SIZE];
+static volatile uint8_t edge_head = 0; // next write index, only written by the GPIO IRQ
+static uint8_t edge_tail = 0;          // next read index
+static uint16_t edge_overruns = 0;
 
-   // only process triggers when GPIO changes and no faster than 50 ms
-   if (!triggers_dirty || time_us_32() > next_update_time_us)
+static uint8_t raw_state = 0;                    // input levels as of the latest edges, before debouncing
+static uint32_t accepted_time_us[TRIGGER_COUNT]; // time of the last debounced edge of each input
+
+static inline void __not_in_flash_func(push_edge)(uint32_t time_us, uint8_t input, bool level) {
+   const uint8_t head = edge_head;
+   const uint8_t next = (head + 1) & TRIGGER_EDGE_FIFO_MASK;
+   if (next == edge_tail) {
+      set_state16(REG_TRIG_EDGE_OVERRUNS_w, ++edge_overruns); // FIFO full, drop edge
       return;
-   next_update_time_us = time_us_32() + 50000ul; // every 50 ms
+   }
 
-   // get trigger IO state as bit field (LSB is trigger 1)
-   const uint8_t state = (gpio_get(PIN_TRIGGER1) << 0)
-#if TRIGGER_COUNT > 1
-                         | (gpio_get(PIN_TRIGGER2) << 1)
-#if TRIGGER_COUNT > 2
-                         | (gpio_get(PIN_TRIGGER3) << 2)
-#if TRIGGER_COUNT > 3
-                         | (gpio_get(PIN_TRIGGER4) << 3)
-#endif
+   edges[head].time_us = time_us;
+   edges[head].input = input;
+   edges[head].level = level;
+   edge_head = next;
+}
+
+void __not_in_flash_func(trigger_callback)(uint gpio, uint32_t events) {
+   const uint32_t now = time_us_32();
+
+   for (uint8_t input = 0; input < TRIGGER_COUNT; input++) {
+      if (trigger_pins[input] != gpio)
+         continue;
+
+      if ((events & GPIO_IRQ_EDGE_RISE) && (events & GPIO_IRQ_EDGE_FALL)) {
+         // Pulse shorter than the IRQ latency, the current level is the last edge
+         const bool level = gpio_get(gpio);
+         push_edge(now, input, !level);
+         push_edge(now, input, level);
+      } else {
+         push_edge(now, input, events & GPIO_IRQ_EDGE_RISE);
+      }
+      return;
+   }
+}
 #endif
+
+void triggers_init() {
+#if TRIGGER_COUNT > 0
+   const uint32_t now = time_us_32();
+   for (uint8_t input = 0; input < TRIGGER_COUNT; input++) {
+      if (gpio_get(trigger_pins[input]))
+         input_state |= 1 << input;
+      accepted_time_us[input] = now - UINT16_MAX; // allow an edge straight away
+   }
+   raw_state = input_state;
+
+   for (uint8_t input = 0; input < TRIGGER_COUNT; input++)
+      gpio_set_irq_enabled_with_callback(trigger_pins[input], GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true, &trigger_callback);
 #endif
-       ;
 
-   for (uint32_t trig_index = 0; trig_index < MAX_TRIGS; trig_index++) {
-      const uint8_t offset = TRIG_SIZE * trig_index;
+   for (uint32_t trig_index = 0; trig_index < MAX_TRIGS; trig_index++)
+      set_state16(REG_TRIGn_SOURCE_w + trig_index * 2, 0); // all inputs from trigger pins
 
-      const uint8_t input = get_state(offset + REG_TRIGn_INPUT);
-      const uint8_t trigger_mask = input >> 4;
-      const uint8_t trigger_invert_mask = input & 0xf;
+   for (uint8_t input = 0; input < 4; input++)
+      set_state16(REG_TRIG_DEBOUNCE_w + input * 2, TRIGGER_DEFAULT_DEBOUNCE_US);
 
-      if (!trigger_mask)
-         continue;
+   set_state(REG_TRIG_INPUT_STATE, input_state);
+}
+
+void triggers_notify() {
+   triggers_dirty = true;
+}
+
+// Update a threshold with a new value (counts with q fraction bits), applying hysteresis. The on/off levels are whole counts,
+// so are scaled up rather than the value scaled down. Triggers are processed on the next update if the state changed.
+static void threshold_update(uint8_t index, uint16_t value, uint8_t q) {
+   const uint16_t offset = THRESHOLD_SIZE * index;
+   const uint8_t bit = 1 << index;
+
+   set_state16(REG_THRESHn_VALUE_w + index * 2, value >> q);
 
-      const uint8_t output = get_state(offset + REG_TRIGn_OUTPUT);
-      const trigger_op_t trigger_op = output >> 4;
-      const bool output_invert = !!(output & 0xf);
+   uint8_t state = threshold_state;
+   if (value >= (uint32_t)get_state16(REG_THRESHn_ON_w + offset) << q)
+      state |= bit;
+   else if (value < (uint32_t)get_state16(REG_THRESHn_OFF_w + offset) << q)
+      state &= ~bit;
 
-      if (trigger_op == TRIGGER_OP_DDD)
+   if (state == threshold_state)
+      return;
+
+   if (state & bit)
+      threshold_rises |= bit;
+   threshold_state = state;
+   set_state(REG_THRESH_STATE, state);
+   triggers_dirty = true;
+}
+
+void triggers_threshold_block(analog_channel_t source, uint16_t level, uint16_t envelope) {
+   for (uint8_t index = 0; index < MAX_THRESHOLDS; index++) {
+      const uint16_t offset = THRESHOLD_SIZE * index;
+      if (get_state(REG_THRESHn_SOURCE + offset) != source)
          continue;
 
-      const uint16_t action = get_state16(offset + REG_TRIGn_ACTION_w);
-      const uint8_t action_start = action >> 8;
-      const uint8_t action_end = action & 0xff;
-      if (!action || (action_start == action_end))
+      const threshold_mode_t mode = get_state(REG_THRESHn_MODE + offset);
+      if (mode == THRESHOLD_MODE_LEVEL)
+         threshold_update(index, level, THRESHOLD_Q);
+      else if (mode == THRESHOLD_MODE_ENVELOPE)
+         threshold_update(index, envelope, THRESHOLD_Q);
+   }
+}
+
+uint8_t triggers_threshold_sources() {
+   uint8_t sources = 0;
+   for (uint8_t index = 0; index < MAX_THRESHOLDS; index++) {
+      const uint16_t offset = THRESHOLD_SIZE * index;
+      const analog_channel_t source = get_state(REG_THRESHn_SOURCE + offset);
+      if (get_state(REG_THRESHn_MODE + offset) != THRESHOLD_MODE_DISABLED && source != AUDIO_CHANNEL_NONE && source <= TOTAL_ANALOG_CHANNELS)
+         sources |= ANALOG_SRC_MASK(source);
+   }
+   return sources;
+}
+
+// Update thresholds using channel sense readings, and clear disabled thresholds
+static void update_thresholds() {
+   for (uint8_t index = 0; index < MAX_THRESHOLDS; index++) {
+      const uint16_t offset = THRESHOLD_SIZE * index;
+      const uint8_t source = get_state(REG_THRESHn_SOURCE + offset);
+      const uint8_t ch_index = source - THRESHOLD_SOURCE_SENSE;
+
+      if (get_state(REG_THRESHn_MODE + offset) == THRESHOLD_MODE_DISABLED) {
+         if (threshold_state & (1 << index)) {
+            threshold_state &= ~(1 << index);
+            set_state(REG_THRESH_STATE, threshold_state);
+            triggers_dirty = true;
+         }
+      } else if (source >= THRESHOLD_SOURCE_SENSE && ch_index < CHANNEL_COUNT) {
+         threshold_update(index, output_sense(ch_index), 0);
+      }
+   }
+}
+
+// Replace the pin state of inputs using a virtual source, with the audio source onset state or analog threshold state
+static inline uint8_t virtual_inputs(uint8_t state, uint8_t onsets, uint8_t thresholds, uint16_t sources) {
+   for (uint8_t i = 0; i < 4; i++) {
+      const uint8_t source = (sources >> (i * 4)) & 0xf;
+
+      bool high;
+      if (source >= TRIGGER_SOURCE_THRESHOLD)
+         high = thresholds & (1 << (source - TRIGGER_SOURCE_THRESHOLD));
+      else if (source != AUDIO_CHANNEL_NONE && source <= TOTAL_ANALOG_CHANNELS)
+         high = onsets & ANALOG_SRC_MASK(source);
+      else
          continue;
 
+      state &= ~(1 << i);
+      if (high)
+         state |= 1 << i;
+   }
+   return state;
+}
+
+// Result of a fixed trigger op for the masked and inverted input state. Returns false for unknown ops.
+static bool op_result(trigger_op_t trigger_op, uint8_t trig_state) {
+   switch (trigger_op) {
+      case TRIGGER_OP_OOO: // t1 || t2 || t3 || t4
+         return !!trig_state;
+      case TRIGGER_OP_OOA: // t1 || t2 || t3 && t4
+         return !!(trig_state & 0b0011) || ((trig_state & 0b1100) == 0b1100);
+      case TRIGGER_OP_OAO: // t1 || t2 && t3 || t4
+         return !!(trig_state & 0b1001) || ((trig_state & 0b0110) == 0b0110);
+      case TRIGGER_OP_OAA: // t1 || t2 && t3 && t4
+         return !!(trig_state & 0b0001) || ((trig_state & 0b1110) == 0b1110);
+      case TRIGGER_OP_AOO: // t1 && t2 || t3 || t4
+         return !!(trig_state & 0b1100) || ((trig_state & 0b0011) == 0b0011);
+      case TRIGGER_OP_AOA: // t1 && t2 || t3 && t4
+         return ((trig_state & 0b1100) == 0b1100) || ((trig_state & 0b0011) == 0b0011);
+      case TRIGGER_OP_AAO: // t1 && t2 && t3 || t4
+         return !!(trig_state & 0b1000) || ((trig_state & 0b0111) == 0b0111);
+      case TRIGGER_OP_AAA: // t1 && t2 && t3 && t4
+         return (trig_state == 0b1111);
+      default:
+         return false;
+   }
+}
+
+// Compile a trigger entry into a truth table indexed by the raw input state, with the input mask, input invert and output invert
+// applied. Returns false if the trigger is disabled.
+static bool compile_trigger(uint8_t trig_index, uint16_t* table) {
+   const uint8_t offset = TRIG_SIZE * trig_index;
+
+   const uint8_t input = get_state(offset + REG_TRIGn_INPUT);
+   const uint8_t trigger_mask = input >> 4;
+   const uint8_t trigger_invert_mask = input & 0xf;
+
+   if (!trigger_mask)
+      return false;
+
+   const uint8_t output = get_state(offset + REG_TRIGn_OUTPUT);
+   const trigger_op_t trigger_op = output >> 4;
+   const bool output_invert = !!(output & 0xf);
+
+   if (trigger_op == TRIGGER_OP_DDD || trigger_op > TRIGGER_OP_TABLE)
+      return false;
+
+   const uint16_t action = get_state16(offset + REG_TRIGn_ACTION_w);
+   const uint8_t action_start = action >> 8;
+   const uint8_t action_end = action & 0xff;
+   if (!action || (action_start == action_end))
+      return false;
+
+   const uint16_t truth_table = get_state16(REG_TRIGn_TABLE_w + trig_index * 2);
+
+   *table = 0;
+   for (uint8_t state = 0; state < TRIGGER_STATES; state++) {
       const uint8_t trig_state = (state & trigger_mask) ^ trigger_invert_mask;
 
       bool result;
-      switch (trigger_op) {
-         case TRIGGER_OP_OOO: // t1 || t2 || t3 || t4
-            result = !!trig_state;
-            break;
-         case TRIGGER_OP_OOA: // t1 || t2 || t3 && t4
-            result = !!(trig_state & 0b0011) || ((trig_state & 0b1100) == 0b1100);
-            break;
-         case TRIGGER_OP_OAO: // t1 || t2 && t3 || t4
-            result = !!(trig_state & 0b1001) || ((trig_state & 0b0110) == 0b0110);
-            break;
-         case TRIGGER_OP_OAA: // t1 || t2 && t3 && t4
-            result = !!(trig_state & 0b0001) || ((trig_state & 0b1110) == 0b1110);
-            break;
-         case TRIGGER_OP_AOO: // t1 && t2 || t3 || t4
-            result = !!(trig_state & 0b1100) || ((trig_state & 0b0011) == 0b0011);
-            break;
-         case TRIGGER_OP_AOA: // t1 && t2 || t3 && t4
-            result = ((trig_state & 0b1100) == 0b1100) || ((trig_state & 0b0011) == 0b0011);
-            break;
-         case TRIGGER_OP_AAO: // t1 && t2 && t3 || t4
-            result = !!(trig_state & 0b1000) || ((trig_state & 0b0111) == 0b0111);
-            break;
-         case TRIGGER_OP_AAA: // t1 && t2 && t3 && t4
-            result = (trig_state == 0b1111);
-            break;
-         default:
-            continue;
+      if (trigger_op == TRIGGER_OP_TABLE)
+         result = (truth_table >> trig_state) & 1;
+      else
+         result = op_result(trigger_op, trig_state);
+
+      if (result ^ output_invert)
+         *table |= 1 << state;
+   }
+   return true;
+}
+
+// Copy a register range into the cache, returning true if it changed
+static bool config_changed(uint8_t* cache, uint16_t address, uint16_t size) {
+   bool changed = false;
+   for (uint16_t i = 0; i < size; i++) {
+      const uint8_t value = get_state(address + i);
+      if (cache[i] != value) {
+         cache[i] = value;
+         changed = true;
       }
+   }
+   return changed;
+}
 
-      result ^= output_invert;
+void triggers_configure() {
+   static uint8_t entries[TRIG_SIZE * MAX_TRIGS];
+   static uint8_t truth_tables[2 * MAX_TRIGS];
+   static uint8_t sources[2 * MAX_TRIGS];
+
+   // Compare every range (no short circuit), so each cache stays up to date
+   bool changed = config_changed(entries, REG_TRIGn_INPUT, sizeof(entries));
+   changed |= config_changed(truth_tables, REG_TRIGn_TABLE_w, sizeof(truth_tables));
+   changed |= config_changed(sources, REG_TRIGn_SOURCE_w, sizeof(sources));
+   if (!changed)
+      return;
 
-      // only trigger action if result is true and has changed since last time
-      if (result != previous_results[trig_index]) {
-         previous_results[trig_index] = result;
-         if (result)
-            execute_action_list(action_start, action_end);
+   enabled_triggers = 0;
+   virtual_triggers = 0;
+   memset(results_by_state, 0, sizeof(results_by_state));
+
+   for (uint8_t trig_index = 0; trig_index < MAX_TRIGS; trig_index++) {
+      const uint32_t bit = 1ul << trig_index;
+      if (!compile_trigger(trig_index, &tables[trig_index]))
+         continue;
+
+      enabled_triggers |= bit;
+      if (get_state16(REG_TRIGn_SOURCE_w + trig_index * 2))
+         virtual_triggers |= bit;
+
+      for (uint8_t state = 0; state < TRIGGER_STATES; state++) {
+         if (tables[trig_index] & (1 << state))
+            results_by_state[state] |= bit;
       }
    }
+}
 
-   triggers_dirty = false;
+// Evaluate trigger expressions with the given input state (bit field, LSB is trigger 1), running the action list of triggers
+// whose result became true. Only triggers whose result changed are touched.
+static void evaluate_triggers(uint8_t state, uint8_t onsets, uint8_t thresholds) {
+   uint32_t results = results_by_state[state & (TRIGGER_STATES - 1)];
+
+   // Triggers with audio onset inputs have their own input state
+   for (uint32_t remaining = virtual_triggers; remaining;) {
+      const uint8_t trig_index = __builtin_ctz(remaining);
+      const uint32_t bit = 1ul << trig_index;
+      remaining &= ~bit;
+
+      const uint8_t inputs = virtual_inputs(state, onsets, thresholds, get_state16(REG_TRIGn_SOURCE_w + trig_index * 2));
+      if (tables[trig_index] & (1 << inputs))
+         results |= bit;
+      else
+         results &= ~bit;
+   }
+
+   const uint32_t changed = (results ^ previous_results) & enabled_triggers;
+   previous_results ^= changed;
+
+   // only trigger action if result is true and has changed since last time
+   for (uint32_t rising = changed & results; rising;) {
+      const uint8_t trig_index = __builtin_ctz(rising);
+      rising &= ~(1ul << trig_index);
+
+      const uint16_t action = get_state16(TRIG_SIZE * trig_index + REG_TRIGn_ACTION_w);
+      execute_action_list(action >> 8, action & 0xff); // start:upper byte, end: lower byte
+   }
+}
+
+#if TRIGGER_COUNT > 0
+// Take a new input level as a debounced edge, evaluating triggers with the updated state
+static void accept_edge(uint8_t input, bool level, uint32_t time_us) {
+   const uint8_t mask = 1 << input;
+   if (!!(input_state & mask) == level)
+      return; // level unchanged
+
+   input_state ^= mask;
+   accepted_time_us[input] = time_us;
+   set_state(REG_TRIG_INPUT_STATE, input_state);
+
+   evaluate_triggers(input_state, 0, threshold_state);
+}
 #endif
+
+void triggers_process() {
+#if TRIGGER_COUNT > 0
+   // Debounce edges in the order they happened. An edge is taken immediately, then edges within the debounce time are ignored.
+   while (edge_tail != edge_head) {
+      const trigger_edge_t* edge = &edges[edge_tail];
+      const uint8_t mask = 1 << edge->input;
+
+      raw_state = edge->level ? raw_state | mask : raw_state & ~mask;
+      if (edge->time_us - accepted_time_us[edge->input] >= get_state16(REG_TRIG_DEBOUNCE_w + edge->input * 2))
+         accept_edge(edge->input, edge->level, edge->time_us);
+
+      edge_tail = (edge_tail + 1) & TRIGGER_EDGE_FIFO_MASK;
+   }
+
+   // Inputs that settled at a different level once the debounce time ended
+   uint8_t unsettled = raw_state ^ input_state;
+   for (uint8_t input = 0; unsettled; input++, unsettled >>= 1) {
+      if (!(unsettled & 1))
+         continue;
+
+      const uint16_t debounce_us = get_state16(REG_TRIG_DEBOUNCE_w + input * 2);
+      if (time_us_32() - accepted_time_us[input] >= debounce_us)
+         accept_edge(input, raw_state & (1 << input), accepted_time_us[input] + debounce_us);
+   }
+#endif
+
+   update_thresholds();
+
+   if (!triggers_dirty)
+      return;
+   triggers_dirty = false;
+
+   // Audio onsets are high for a single update, process again on the next update so they return low.
+   // Thresholds that went high since the last update are also high for an update, so they aren't missed if they already went low.
+   const uint8_t onsets = audio_take_onsets();
+   const uint8_t thresholds = threshold_state | threshold_rises;
+   if (onsets || threshold_rises)
+      triggers_dirty = true;
+   threshold_rises = 0;
+
+   evaluate_triggers(input_state, onsets, thresholds);
 }
\ No newline at end of file
@@ -20,8 +20,25 @@
 
 #include "swx.h"
 
+#include "channel.h"
+
 void triggers_init();
 
 void triggers_process();
 
+// Recompile trigger entries if their registers changed. Each trigger becomes a truth table over the input state, and the results
+// of all triggers are precomputed for every input state, so an edge only touches the triggers whose result changed.
+void triggers_configure();
+
+#define THRESHOLD_Q (6) // fixed point format of capture block levels, 16-bit samples are 10-bit counts with 6 fraction bits
+
+// Update analog thresholds using the capture source with the mean level and envelope of a block of samples (counts, THRESHOLD_Q)
+void triggers_threshold_block(analog_channel_t source, uint16_t level, uint16_t envelope);
+
+// Returns capture sources used by enabled analog thresholds (bit per source, see ANALOG_SRC_MASK)
+uint8_t triggers_threshold_sources();
+
+// Mark trigger inputs as changed, so triggers are processed on the next update (e.g. after an audio onset)
+void triggers_notify();
+
 #endif // _TRIGGER_H
\ No newline at end of file
@@ -0,0 +1,45 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "../swx.h"
+#include <hardware/structs/systick.h>
+
+// Cycle counting using the SysTick timer. The counter is 24-bit and counts down at sys_clk,
+// so intervals must be shorter than 2^24 cycles (~67ms at 250MHz).
+
+#define BENCH_SYSTICK_MASK (0x00FFFFFF)
+
+static inline void bench_init() {
+   systick_hw->csr = 0;
+   systick_hw->rvr = BENCH_SYSTICK_MASK;
+   systick_hw->cvr = 0;
+   systick_hw->csr = 0x5; // enable, processor clock source, no interrupt
+}
+
+static inline uint32_t bench_start() {
+   return systick_hw->cvr;
+}
+
+// Returns the number of cycles elapsed since bench_start()
+static inline uint32_t bench_cycles(uint32_t start) {
+   return (start - systick_hw->cvr) & BENCH_SYSTICK_MASK;
+}
+
+#endif // _BENCH_H
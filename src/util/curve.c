@@ -0,0 +1,71 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "curve.h"
+
+// Lookup table entries are computed by the compiler from constant floating point expressions, nothing is evaluated at runtime
+
+#define CURVE_X(i) ((double)(i) / (1 << CURVE_LUT_BITS))
+#define CURVE_Q15(y) ((uint16_t)((y)*CURVE_ONE + 0.5))
+
+// e^y as (1 + y/64)^64, since library functions can't be used in constant expressions. Within 0.24% of full scale
+// over the range used here, and exact at the curve end points since the curves are normalized.
+#define CURVE_SQ(a) ((a) * (a))
+#define CURVE_EXP(y) CURVE_SQ(CURVE_SQ(CURVE_SQ(CURVE_SQ(CURVE_SQ(CURVE_SQ(1.0 + (y) / 64.0))))))
+
+#define CURVE_EXP_K (4.0) // steepness of the exponential curves (end slope is ~4x the linear slope)
+
+#define CURVE_EXPONENTIAL(x) ((CURVE_EXP(CURVE_EXP_K * ((x)-1.0)) - CURVE_EXP(-CURVE_EXP_K)) / (1.0 - CURVE_EXP(-CURVE_EXP_K)))
+#define CURVE_S_CURVE(x) ((x) * (x) * (x) * ((x) * ((x)*6.0 - 15.0) + 10.0))
+#define CURVE_LOGARITHMIC(x) (1.0 - CURVE_EXPONENTIAL(1.0 - (x)))
+
+#define CURVE_ENTRY_EXPONENTIAL(i) CURVE_Q15(CURVE_EXPONENTIAL(CURVE_X(i)))
+#define CURVE_ENTRY_S_CURVE(i) CURVE_Q15(CURVE_S_CURVE(CURVE_X(i)))
+#define CURVE_ENTRY_LOGARITHMIC(i) CURVE_Q15(CURVE_LOGARITHMIC(CURVE_X(i)))
+
+// One table of CURVE_LUT_SIZE entries
+#define CURVE_TABLE(entry)                                                                                         \
+   {                                                                                                               \
+      entry(0), entry(1), entry(2), entry(3), entry(4), entry(5), entry(6), entry(7), entry(8), entry(9), entry(10),\
+      entry(11), entry(12), entry(13), entry(14), entry(15), entry(16), entry(17), entry(18), entry(19), entry(20),\
+      entry(21), entry(22), entry(23), entry(24), entry(25), entry(26), entry(27), entry(28), entry(29), entry(30),\
+      entry(31), entry(32)                                                                                         \
+   }
+
+static_assert(CURVE_LUT_SIZE == 33); // Ensure CURVE_TABLE lists every entry
+
+// Tables for each curve after RAMP_CURVE_LINEAR, which doesn't need one
+static const uint16_t curve_tables[TOTAL_RAMP_CURVES - 1][CURVE_LUT_SIZE] = {
+    [RAMP_CURVE_EXPONENTIAL - 1] = CURVE_TABLE(CURVE_ENTRY_EXPONENTIAL),
+    [RAMP_CURVE_S_CURVE - 1] = CURVE_TABLE(CURVE_ENTRY_S_CURVE),
+    [RAMP_CURVE_LOGARITHMIC - 1] = CURVE_TABLE(CURVE_ENTRY_LOGARITHMIC),
+};
+
+uint16_t curve_lookup(ramp_curve_t curve, uint16_t phase) {
+   if (phase >= CURVE_ONE)
+      return CURVE_ONE;
+
+   if (curve == RAMP_CURVE_LINEAR || curve >= TOTAL_RAMP_CURVES)
+      return phase;
+
+   const uint16_t* table = curve_tables[curve - 1];
+   const uint16_t index = phase >> CURVE_FRAC_BITS;
+   const uint16_t frac = phase & ((1 << CURVE_FRAC_BITS) - 1);
+
+   // Tables only increase, so the difference between entries is never negative
+   return table[index] + (((uint32_t)(table[index + 1] - table[index]) * frac) >> CURVE_FRAC_BITS);
+}
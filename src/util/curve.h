@@ -0,0 +1,34 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _CURVE_H
+#define _CURVE_H
+
+#include "../swx.h"
+#include "parameter.h"
+
+#define CURVE_ONE (32768) // Q15 1.0, the end of a curve
+
+#define CURVE_LUT_BITS (5)                         // log2 of segments per lookup table
+#define CURVE_LUT_SIZE ((1 << CURVE_LUT_BITS) + 1) // entries per lookup table, including the end point
+#define CURVE_FRAC_BITS (15 - CURVE_LUT_BITS)      // phase bits interpolated between entries
+
+// Shape a ramp phase (Q15, 0 to CURVE_ONE) using the curve. Returns the curve value (Q15, 0 to CURVE_ONE).
+// Curves are lookup tables built at compile time, linearly interpolated between entries using integer math only.
+uint16_t curve_lookup(ramp_curve_t curve, uint16_t phase);
+
+#endif // _CURVE_H
@@ -0,0 +1,60 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include "../swx.h"
+
+// Second order state variable filter (Chamberlin), fixed point for the M0+ (no FPU/SIMD, single cycle 32-bit multiply).
+// Two multiplies per sample, and unlike a direct form biquad, coefficients stay well conditioned at low center frequencies.
+// Stable for center frequencies up to about a sixth of the sample rate, svf_design() clamps to this.
+
+#define SVF_Q (14) // coefficient fixed point format
+
+typedef struct {
+   int32_t f; // 2 * sin(pi * fc / fs) (Q14)
+   int32_t q; // damping, 1 / Q (Q14)
+} svf_coeffs_t;
+
+typedef struct {
+   int32_t low;
+   int32_t band;
+} svf_state_t;
+
+// Compute coefficients for the center frequency (Hz) at the sample period (Q8 microseconds), with damping (Q14).
+static inline void svf_design(svf_coeffs_t* c, uint16_t center_hz, uint32_t period_q8, int32_t damping_q14) {
+   // theta = pi * fc * T (Q16), clamped to keep the filter stable
+   uint32_t theta = ((uint64_t)center_hz * period_q8 * 205887) / 256000000ull; // 205887 = pi * 2^16
+   if (theta > 29491)                                                           // 0.45 rad, f ~0.87
+      theta = 29491;
+
+   // f = 2 * sin(theta), using sin(x) ~ x - x^3 / 6 (error < 0.1% in the clamped range)
+   const uint32_t theta3 = (((theta * theta) >> 16) * theta) >> 16;
+   c->f = (2 * (theta - theta3 / 6)) >> (16 - SVF_Q);
+   c->q = damping_q14;
+}
+
+// Filter a sample (signal up to 16 bits), returning the band pass output normalized to unity gain at the center frequency.
+static inline int32_t svf_bandpass(svf_state_t* s, const svf_coeffs_t* c, int32_t x) {
+   s->low += (c->f * s->band) >> SVF_Q;
+   const int32_t high = x - s->low - ((c->q * s->band) >> SVF_Q);
+   s->band += (c->f * high) >> SVF_Q;
+   return (s->band * c->q) >> SVF_Q;
+}
+
+#endif // _FILTER_H
@@ -0,0 +1,87 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pitch.h"
+
+#include <stdlib.h>
+
+// Average magnitude difference between the window and the window delayed by lag. Samples must be within +/-1024 so the sum fits 18 bits.
+static inline uint32_t difference(const int16_t* history, uint16_t lag) {
+   const int16_t* a = history;
+   const int16_t* b = history + lag;
+
+   uint32_t sum = 0;
+   for (uint16_t i = 0; i < PITCH_WINDOW; i += 4) { // unrolled, M0+ has no branch prediction
+      sum += abs(a[i] - b[i]);
+      sum += abs(a[i + 1] - b[i + 1]);
+      sum += abs(a[i + 2] - b[i + 2]);
+      sum += abs(a[i + 3] - b[i + 3]);
+   }
+   return sum;
+}
+
+uint32_t pitch_estimate(const int16_t* history, uint16_t min_lag, uint16_t max_lag) {
+   static uint32_t d[PITCH_MAX_LAG + 2];
+
+   if (min_lag < 2)
+      min_lag = 2;
+   if (max_lag > PITCH_MAX_LAG)
+      max_lag = PITCH_MAX_LAG;
+   if (min_lag >= max_lag)
+      return 0;
+
+   // Cumulative mean normalization needs the difference of every lag from 1
+   uint32_t cumulative = 0;
+   for (uint16_t lag = 1; lag < min_lag; lag++) {
+      d[lag] = difference(history, lag);
+      cumulative += d[lag];
+   }
+
+   // Find the first lag where the normalized difference d(lag) / mean(d(1..lag)) drops below threshold,
+   // compared without division: d(lag) * lag < threshold * sum(d(1..lag))
+   for (uint16_t lag = min_lag; lag <= max_lag; lag++) {
+      d[lag] = difference(history, lag);
+      cumulative += d[lag];
+
+      if (((d[lag] * lag) << 6) >= PITCH_THRESHOLD_Q6 * cumulative)
+         continue;
+
+      // Walk down to the bottom of the dip
+      d[lag + 1] = difference(history, lag + 1);
+      while (lag < max_lag && d[lag + 1] < d[lag]) {
+         lag++;
+         d[lag + 1] = difference(history, lag + 1);
+      }
+
+      // Parabolic interpolation around the minimum
+      const int32_t prev = d[lag - 1];
+      const int32_t next = d[lag + 1];
+      const int32_t den = prev + next - 2 * (int32_t)d[lag];
+
+      int32_t offset_q8 = 0;
+      if (den > 0) {
+         offset_q8 = ((prev - next) << 7) / den;
+         if (offset_q8 > 128)
+            offset_q8 = 128;
+         else if (offset_q8 < -128)
+            offset_q8 = -128;
+      }
+      return (lag << 8) + offset_q8;
+   }
+
+   return 0; // not periodic
+}
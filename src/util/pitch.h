@@ -0,0 +1,34 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _PITCH_H
+#define _PITCH_H
+
+#include "../swx.h"
+
+#define PITCH_WINDOW (128)                               // samples compared per lag
+#define PITCH_MAX_LAG (128)                              // longest detectable period in samples
+#define PITCH_HISTORY (PITCH_WINDOW + PITCH_MAX_LAG + 1) // samples needed by pitch_estimate()
+
+#define PITCH_THRESHOLD_Q6 (16) // normalized difference threshold (0.25) for a lag to be considered periodic
+
+// Estimate the fundamental period of the signal in history (PITCH_HISTORY samples, oldest first), searching between min_lag and max_lag.
+// YIN-style: average magnitude difference function with cumulative mean normalization, using integer math only.
+// Returns the period in samples (Q8, parabolic interpolated), or 0 if no periodic signal was found.
+uint32_t pitch_estimate(const int16_t* history, uint16_t min_lag, uint16_t max_lag);
+
+#endif // _PITCH_H
@@ -0,0 +1,181 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "swar.h"
+
+typedef uint32_t __attribute__((may_alias)) swar_word_t; // two packed samples, low lane is the lower address
+
+#define LANE_HIGH_BITS (0x80008000) // top bit of each lane
+#define U12_HIGH_MASK (0xFFF0FFF0)  // left justified 12-bit samples in each lane
+
+static inline bool same_parity(const void* a, const void* b) {
+   return !(((uintptr_t)a ^ (uintptr_t)b) & 2);
+}
+
+static inline bool word_aligned(const void* p) {
+   return !((uintptr_t)p & 3);
+}
+
+// Returns 0xFFFF in each lane where a >= b, else 0. The low 15 bits are compared with the top bit set to stop borrows between
+// lanes, then the top bits decide lanes where they differ.
+static inline uint32_t lanes_ge(uint32_t a, uint32_t b) {
+   const uint32_t low_ge = (a | LANE_HIGH_BITS) - (b & ~LANE_HIGH_BITS);
+   const uint32_t ge = ((a & ~b) | (~(a ^ b) & low_ge)) & LANE_HIGH_BITS;
+   return ge | (ge - (ge >> 15));
+}
+
+// Update min and max with a sample, returning it to be summed
+static inline uint16_t fold_sample(uint16_t sample, uint16_t* min, uint16_t* max) {
+   if (sample < *min)
+      *min = sample;
+   if (sample > *max)
+      *max = sample;
+   return sample;
+}
+
+void swar_adc12_to_u16_scalar(uint16_t* dst, const uint16_t* src, uint16_t count) {
+   for (uint16_t i = 0; i < count; i++)
+      dst[i] = (src[i] & 0xFFF) << 4;
+}
+
+void swar_pcm16_to_u16_scalar(uint16_t* dst, const uint16_t* src, uint16_t count) {
+   for (uint16_t i = 0; i < count; i++)
+      dst[i] = src[i] ^ 0x8000;
+}
+
+void swar_gather_scalar(uint16_t* dst, const uint16_t* src, uint16_t count, uint8_t stride) {
+   for (uint16_t i = 0; i < count; i++)
+      dst[i] = src[i * stride];
+}
+
+uint32_t swar_minmax_sum_scalar(const uint16_t* src, uint16_t count, uint16_t* min, uint16_t* max) {
+   uint16_t lo = UINT16_MAX, hi = 0;
+   uint32_t sum = 0;
+   for (uint16_t i = 0; i < count; i++) {
+      const uint16_t sample = src[i];
+      if (sample > hi)
+         hi = sample;
+      if (sample < lo)
+         lo = sample;
+      sum += sample;
+   }
+   *min = lo;
+   *max = hi;
+   return sum;
+}
+
+void swar_adc12_to_u16(uint16_t* dst, const uint16_t* src, uint16_t count) {
+   if (!same_parity(dst, src) || count < 4) {
+      swar_adc12_to_u16_scalar(dst, src, count);
+      return;
+   }
+
+   uint16_t head = word_aligned(src) ? 0 : 1;
+   swar_adc12_to_u16_scalar(dst, src, head);
+
+   const swar_word_t* s = (const swar_word_t*)(src + head);
+   swar_word_t* d = (swar_word_t*)(dst + head);
+   const uint16_t words = (count - head) / 2;
+   for (uint16_t i = 0; i < words; i++)
+      d[i] = (s[i] << 4) & U12_HIGH_MASK; // bits 0-11 of each lane to the top, bits carried into the high lane are masked off
+
+   const uint16_t done = head + words * 2;
+   swar_adc12_to_u16_scalar(dst + done, src + done, count - done);
+}
+
+void swar_pcm16_to_u16(uint16_t* dst, const uint16_t* src, uint16_t count) {
+   if (!same_parity(dst, src) || count < 4) {
+      swar_pcm16_to_u16_scalar(dst, src, count);
+      return;
+   }
+
+   uint16_t head = word_aligned(src) ? 0 : 1;
+   swar_pcm16_to_u16_scalar(dst, src, head);
+
+   const swar_word_t* s = (const swar_word_t*)(src + head);
+   swar_word_t* d = (swar_word_t*)(dst + head);
+   const uint16_t words = (count - head) / 2;
+   for (uint16_t i = 0; i < words; i++)
+      d[i] = s[i] ^ LANE_HIGH_BITS; // flip sign bits to offset binary
+
+   const uint16_t done = head + words * 2;
+   swar_pcm16_to_u16_scalar(dst + done, src + done, count - done);
+}
+
+void swar_gather(uint16_t* dst, const uint16_t* src, uint16_t count, uint8_t stride) {
+   if ((stride & 1) || !word_aligned(dst) || count < 4) {
+      swar_gather_scalar(dst, src, count, stride);
+      return;
+   }
+
+   // Every sample sits in the same lane of a word, consecutive samples are stride / 2 words apart
+   const swar_word_t* s = (const swar_word_t*)((uintptr_t)src & ~3);
+   swar_word_t* d = (swar_word_t*)dst;
+   const uint8_t step = stride / 2;
+   const uint16_t words = count / 2;
+
+   if (word_aligned(src)) {
+      for (uint16_t i = 0; i < words; i++, s += stride)
+         d[i] = (s[0] & 0xFFFF) | (s[step] << 16);
+   } else {
+      for (uint16_t i = 0; i < words; i++, s += stride)
+         d[i] = (s[0] >> 16) | (s[step] & 0xFFFF0000);
+   }
+
+   if (count & 1)
+      dst[count - 1] = src[(count - 1) * stride];
+}
+
+uint32_t swar_minmax_sum(const uint16_t* src, uint16_t count, uint16_t* min, uint16_t* max) {
+   if (count < 4)
+      return swar_minmax_sum_scalar(src, count, min, max);
+
+   // Leftover samples are folded in at the end
+   const uint16_t head = word_aligned(src) ? 0 : 1;
+   const uint16_t words = (count - head) / 2;
+   const uint16_t done = head + words * 2;
+
+   const swar_word_t* s = (const swar_word_t*)(src + head);
+   uint32_t lo = s[0];
+   uint32_t hi = s[0];
+   uint32_t sum = 0;
+
+   // Full 16-bit lanes would overflow a packed sum, so lanes are summed separately
+   for (uint16_t i = 0; i < words; i++) {
+      const uint32_t w = s[i];
+      sum += (w & 0xFFFF) + (w >> 16);
+
+      const uint32_t ge_hi = lanes_ge(w, hi);
+      hi = (w & ge_hi) | (hi & ~ge_hi);
+
+      const uint32_t ge_lo = lanes_ge(w, lo);
+      lo = (lo & ge_lo) | (w & ~ge_lo);
+   }
+
+   uint16_t lo16 = MIN(lo & 0xFFFF, lo >> 16);
+   uint16_t hi16 = MAX(hi & 0xFFFF, hi >> 16);
+
+   // Samples not covered by whole words, at most one either side
+   if (head)
+      sum += fold_sample(src[0], &lo16, &hi16);
+   if (done < count)
+      sum += fold_sample(src[count - 1], &lo16, &hi16);
+
+   *min = lo16;
+   *max = hi16;
+   return sum;
+}
@@ -0,0 +1,45 @@
+/*
+ * swx
+ * Copyright (C) 2023 saawsm
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _SWAR_H
+#define _SWAR_H
+
+#include "../swx.h"
+
+// SIMD within a register kernels for 16-bit samples. The M0+ has no SIMD instructions, but operating on two samples packed in
+// a 32-bit word halves the loads, stores and loop overhead. Words are only accessed when both pointers share the same 16-bit
+// parity, otherwise (and for leftover samples) the matching scalar versions are used. dst may equal src.
+
+// Convert 12-bit ADC samples into 16-bit samples (left justified)
+void swar_adc12_to_u16(uint16_t* dst, const uint16_t* src, uint16_t count);
+
+// Convert signed 16-bit PCM samples into 16-bit offset binary samples, so silence is mid-scale like the ADC
+void swar_pcm16_to_u16(uint16_t* dst, const uint16_t* src, uint16_t count);
+
+// Copy every stride'th sample of src into dst. Packed for even strides (samples in 32-bit slots, or interleaved pairs).
+void swar_gather(uint16_t* dst, const uint16_t* src, uint16_t count, uint8_t stride);
+
+// Returns the sum of samples, also finding the min and max. Count must be non-zero.
+uint32_t swar_minmax_sum(const uint16_t* src, uint16_t count, uint16_t* min, uint16_t* max);
+
+// Scalar versions, one sample at a time
+void swar_adc12_to_u16_scalar(uint16_t* dst, const uint16_t* src, uint16_t count);
+void swar_pcm16_to_u16_scalar(uint16_t* dst, const uint16_t* src, uint16_t count);
+void swar_gather_scalar(uint16_t* dst, const uint16_t* src, uint16_t count, uint8_t stride);
+uint32_t swar_minmax_sum_scalar(const uint16_t* src, uint16_t count, uint16_t* min, uint16_t* max);
+
+#endif // _SWAR_H